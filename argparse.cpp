@@ -102,6 +102,9 @@ bool parse_args(int argc, char * argv[], std::initializer_list<param_definition>
 		case param_definition::target_type::integer:
 			*static_cast<int *>(tgt.ptr) = std::stoi(val);
 			break;
+		case param_definition::target_type::flag:
+			*static_cast<bool *>(tgt.ptr) = true;
+			break;
 		}
 
 		return action::remove;
@@ -141,7 +144,12 @@ bool parse_args(int argc, char * argv[], std::initializer_list<param_definition>
 		if (it == opt_defs.end())
 			return false;
 
-		action act = store((*it)->var_, args.pop());
+		action act;
+		if ((*it)->var_.type == param_definition::target_type::flag)
+			act = store((*it)->var_, {});
+		else
+			act = store((*it)->var_, args.pop());
+
 		if (act == action::remove)
 			opt_defs.erase(it);
 		return true;
@@ -225,12 +233,22 @@ std::string format_opt_help(std::string_view prog_name, param_definition const *
 		if (!param.required_)
 			ss << "[";
 
-		if (param.short_opt_)
-			ss << "-" << param.short_opt_ << " ";
-		else if (starts_with(param.long_opt_, "--"))
-			ss << param.long_opt_ << " ";
+		if (param.var_.type == param_definition::target_type::flag)
+		{
+			if (param.short_opt_)
+				ss << "-" << param.short_opt_;
+			else
+				ss << param.long_opt_;
+		}
+		else
+		{
+			if (param.short_opt_)
+				ss << "-" << param.short_opt_ << " ";
+			else if (starts_with(param.long_opt_, "--"))
+				ss << param.long_opt_ << " ";
 
-		ss << param.metavar_;
+			ss << param.metavar_;
+		}
 
 		if (!param.required_)
 			ss << "]";
@@ -9,7 +9,7 @@
 
 struct param_definition final
 {
-	enum class target_type { string, integer };
+	enum class target_type { string, integer, flag };
 
 	struct target
 	{
@@ -25,6 +25,11 @@ struct param_definition final
 			: type(target_type::integer), ptr(&var)
 		{
 		}
+
+		target(bool & var)
+			: type(target_type::flag), ptr(&var)
+		{
+		}
 	};
 
 	param_definition(target var, std::string_view long_opt);
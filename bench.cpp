@@ -0,0 +1,514 @@
+#include "argparse.hpp"
+#include "chan.hpp"
+#include "exec_registry.hpp"
+#include "file.hpp"
+#include "format.hpp"
+#include "json_writer.hpp"
+#include "tar.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <json.hpp>
+using nlohmann::json;
+
+// Measures the throughput of the tar and gzip paths that GET and POST /tar
+// run through, on synthetic trees. Results go out as JSON, so that runs
+// of different commits can be compared.
+
+// Every allocation is counted, so that benchmarks can report allocations per call.
+static std::atomic<uint64_t> g_allocations{ 0 };
+
+void * operator new(size_t size)
+{
+	g_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void * p = malloc(size? size: 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+	free(p);
+}
+
+namespace {
+
+struct tree_spec
+{
+	char const * name;
+	size_t file_count;
+	uint64_t min_size;
+	uint64_t max_size;
+};
+
+// Sizes are drawn log-uniformly between the bounds.
+tree_spec const g_trees[] = {
+	{ "many_tiny", 20000, 0, 1024 },
+	{ "mixed", 2000, 100, 1024 * 1024 },
+	{ "few_huge", 4, 32 * 1024 * 1024, 32 * 1024 * 1024 },
+};
+
+struct xorshift
+{
+	uint64_t state = 0x9e3779b97f4a7c15;
+
+	uint64_t next()
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	// Uniform in [0, 1).
+	double real()
+	{
+		return (double)(this->next() >> 11) / (double)((uint64_t)1 << 53);
+	}
+};
+
+// Text-like content, compresses about as well as source code does.
+void fill_content(xorshift & rng, char * buf, size_t len)
+{
+	static char const words[][8] = { "int ", "return ", "if (", ") {\n", "\t", "x", "y = ", "0;\n", "for ", "std::" };
+
+	size_t pos = 0;
+	while (pos < len)
+	{
+		char const * w = words[rng.next() % (sizeof words / sizeof words[0])];
+		for (; *w && pos < len; ++w)
+			buf[pos++] = *w;
+	}
+}
+
+struct null_ostream final
+	: ostream
+{
+	uint64_t bytes = 0;
+
+	size_t write(char const * buf, size_t len) override
+	{
+		bytes += len;
+		return len;
+	}
+};
+
+struct string_ostream final
+	: ostream
+{
+	std::string data;
+
+	size_t write(char const * buf, size_t len) override
+	{
+		data.append(buf, len);
+		return len;
+	}
+};
+
+uint64_t make_tree(std::string const & root, tree_spec const & spec, size_t scale)
+{
+	xorshift rng;
+	std::vector<char> buf(1024 * 1024);
+
+	size_t file_count = std::max<size_t>(spec.file_count / scale, 1);
+	uint64_t total = 0;
+
+	for (size_t i = 0; i != file_count; ++i)
+	{
+		// A hundred files per directory.
+		std::string dir = join_paths(root, format(FMT("d{}"), i / 100));
+		if (i % 100 == 0)
+			makedirs(dir);
+
+		uint64_t size = spec.min_size;
+		if (spec.max_size > spec.min_size)
+		{
+			double lo = std::log((double)spec.min_size + 1);
+			double hi = std::log((double)spec.max_size + 1);
+			size = (uint64_t)std::exp(lo + (hi - lo) * rng.real()) - 1;
+		}
+
+		if (spec.min_size == spec.max_size)
+			size = std::max<uint64_t>(size / scale, 1);
+
+		file fout;
+		fout.create(join_paths(dir, format(FMT("f{}"), i)));
+
+		uint64_t left = size;
+		while (left)
+		{
+			size_t chunk = (size_t)std::min<uint64_t>(left, buf.size());
+			fill_content(rng, buf.data(), chunk);
+			fout.out_stream().write_all(buf.data(), chunk);
+			left -= chunk;
+		}
+
+		total += size;
+	}
+
+	return total;
+}
+
+void write_tar(std::string const & root, ostream & out)
+{
+	tarfile_writer tw(out);
+	enum_files(root, [&](std::string_view fname) {
+		file fin;
+		fin.open_ro(join_paths(root, fname));
+		tw.add(fname, fin.size(), fin.mtime(), fin.in_stream());
+	});
+	tw.close();
+}
+
+struct runner
+{
+	int repeat;
+	json results = json::array();
+
+	// Runs `fn` `repeat` times, `fn` returns the number of bytes it processed.
+	// The fastest run is reported, it's the least disturbed by the rest of the system.
+	// Returns the result record, so that the caller can add to it.
+	json & run(char const * name, char const * tree, char const * fs, std::function<uint64_t()> const & fn)
+	{
+		double best = 0;
+		uint64_t bytes = 0;
+
+		for (int i = 0; i < repeat; ++i)
+		{
+			auto start = std::chrono::steady_clock::now();
+			bytes = fn();
+			std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+
+			if (i == 0 || d.count() < best)
+				best = d.count();
+		}
+
+		json r = {
+			{ "benchmark", name },
+			{ "tree", tree },
+			{ "fs", fs },
+			{ "bytes", bytes },
+			{ "seconds", best },
+			{ "mb_per_s", best > 0? bytes / best / 1e6: 0.0 },
+		};
+
+		std::cerr << name << " " << tree << " " << fs << ": " << r["mb_per_s"].get<double>() << " MB/s\n";
+		results.push_back(std::move(r));
+		return results.back();
+	}
+};
+
+void bench_tree(runner & rn, tree_spec const & spec, std::string const & fs_name, std::string const & fs_dir, size_t scale, bool in_memory)
+{
+	std::string root = join_paths(fs_dir, format(FMT("agent_maybe_bench.{}"), spec.name));
+	std::string src = join_paths(root, "src");
+	std::string dst = join_paths(root, "dst");
+
+	std::error_code ec;
+	rmtree(root, ec);
+	makedirs(src);
+
+	make_tree(src, spec, scale);
+
+	string_ostream tar;
+	write_tar(src, tar);
+
+	rn.run("tar_write", spec.name, fs_name.c_str(), [&] {
+		null_ostream out;
+		write_tar(src, out);
+		return out.bytes;
+	});
+
+	// The same archive, streamed through `make_istream` the way GET /tar
+	// serves it; every read is a switch to the writer and back.
+	size_t const chan_chunk = 64 * 1024;
+	uint64_t switches = 0;
+	json & chan_result = rn.run("tar_write_chan", spec.name, fs_name.c_str(), [&] {
+		auto body = make_istream([&](ostream & out) { write_tar(src, out); });
+
+		std::vector<char> buf(chan_chunk);
+		uint64_t bytes = 0;
+		switches = 0;
+		for (;;)
+		{
+			size_t r = body->read(buf.data(), buf.size());
+			++switches;
+			if (r == 0)
+				break;
+			bytes += r;
+		}
+		return bytes;
+	});
+	chan_result["switches"] = switches;
+
+	rn.run("tar_extract", spec.name, fs_name.c_str(), [&] {
+		rmtree(dst, ec);
+		makedirs(dst);
+
+		memory_istream in(tar.data);
+		tarfile_reader tr(in);
+
+		std::string name;
+		uint64_t size;
+		std::shared_ptr<istream> content;
+		while (tr.next(name, size, content))
+		{
+			std::string path = join_paths(dst, name);
+			makedirs(path.substr(0, path.rfind('/')));
+
+			file fout;
+			fout.create(path);
+			tr.copy_content(fout.out_stream());
+		}
+
+		return (uint64_t)tar.data.size();
+	});
+
+	rmtree(root, ec);
+
+	// The rest doesn't touch the filesystem, it only needs to run once per tree.
+	if (!in_memory)
+		return;
+
+	rn.run("tar_read", spec.name, "memory", [&] {
+		memory_istream in(tar.data);
+		tarfile_reader tr(in);
+
+		std::string name;
+		uint64_t size;
+		std::shared_ptr<istream> content;
+		null_ostream out;
+		while (tr.next(name, size, content))
+			tr.copy_content(out);
+
+		return (uint64_t)tar.data.size();
+	});
+
+	string_ostream gz;
+	{
+		filter_writer<deflate_filter> w(gz, /*compress=*/true);
+		w.write_all(tar.data.data(), tar.data.size());
+		w.close();
+	}
+
+	json & gz_result = rn.run("gzip_compress", spec.name, "memory", [&] {
+		null_ostream out;
+		filter_writer<deflate_filter> w(out, /*compress=*/true);
+		w.write_all(tar.data.data(), tar.data.size());
+		w.close();
+		return (uint64_t)tar.data.size();
+	});
+	gz_result["ratio"] = (double)gz.data.size() / tar.data.size();
+
+	rn.run("gzip_decompress_buffer", spec.name, "memory", [&] {
+		std::string out;
+		if (!gunzip_buffer(gz.data, out, SIZE_MAX))
+			throw std::runtime_error("gunzip_buffer failed");
+		return (uint64_t)out.size();
+	});
+
+	rn.run("gzip_decompress", spec.name, "memory", [&] {
+		memory_istream in(gz.data);
+		filter_reader<deflate_filter> r(in, /*compress=*/false);
+		null_ostream out;
+		copy(out, r);
+		return out.bytes;
+	});
+}
+
+// The runtime-parsed `format` the agent used before FMT, as the baseline.
+namespace legacy {
+
+void format_append(std::string & r, std::string_view fmt)
+{
+	r.append(fmt.data(), fmt.size());
+}
+
+void format_append_one(std::string & r, std::string_view v)
+{
+	r.append(v.data(), v.size());
+}
+
+template <typename Integral>
+std::enable_if_t<std::is_integral<Integral>::value, void> format_append_one(std::string & r, Integral v)
+{
+	r.append(std::to_string(v));
+}
+
+template <typename P0, typename... P>
+void format_append(std::string & r, std::string_view fmt, P0 && p0, P &&... p)
+{
+	for (size_t i = 0; i + 1 < fmt.size(); ++i)
+	{
+		if (fmt[i] == '{' && fmt[i + 1] == '}')
+		{
+			r.append(fmt.data(), i);
+			format_append_one(r, std::forward<P0>(p0));
+			return format_append(r, fmt.substr(i + 2), std::forward<P>(p)...);
+		}
+	}
+
+	r.append(fmt.data(), fmt.size());
+}
+
+template <typename... P>
+std::string format(std::string_view fmt, P &&... p)
+{
+	std::string r;
+	format_append(r, fmt, std::forward<P>(p)...);
+	return r;
+}
+
+}
+
+// Formats what the agent formats most: exec URLs and metric samples.
+void bench_format(runner & rn)
+{
+	size_t const calls = 1000000;
+	std::string const uuid = "0b7c6d2e-5a1f-4c3e-9d8b-7a6f5e4d3c2b";
+
+	auto record = [&](json & r) {
+		r["ns_per_call"] = r["seconds"].get<double>() * 1e9 / (2 * calls);
+	};
+
+	record(rn.run("format_legacy", "", "memory", [&] {
+		uint64_t bytes = 0;
+		for (size_t i = 0; i != calls; ++i)
+		{
+			bytes += legacy::format("exec/{}-{}", uuid, i).size();
+			bytes += legacy::format("{}_count{{}} {}\n", "agent_request_duration_seconds", "route=\"/tar\"", i * 7919).size();
+		}
+		return bytes;
+	}));
+
+	record(rn.run("format", "", "memory", [&] {
+		uint64_t bytes = 0;
+		for (size_t i = 0; i != calls; ++i)
+		{
+			bytes += format(FMT("exec/{}-{}"), uuid, i).size();
+			bytes += format(FMT("{}_count{{}} {}\n"), "agent_request_duration_seconds", "route=\"/tar\"", i * 7919).size();
+		}
+		return bytes;
+	}));
+
+	record(rn.run("format_to", "", "memory", [&] {
+		std::string out;
+		uint64_t bytes = 0;
+		for (size_t i = 0; i != calls; ++i)
+		{
+			out.clear();
+			format_to(out, FMT("exec/{}-{}"), uuid, i);
+			format_to(out, FMT("{}_count{{}} {}\n"), "agent_request_duration_seconds", "route=\"/tar\"", i * 7919);
+			bytes += out.size();
+		}
+		return bytes;
+	}));
+}
+
+// Builds the response of GET /exec/<id> for a running process,
+// the way format_exec_status did before json_writer and with the real one.
+void bench_status(runner & rn)
+{
+	size_t const calls = 200000;
+
+	size_t const id = 1234;
+	std::vector<std::string> const cmd = { "/usr/bin/cmake", "--build", "/home/build/out/release", "--target", "all", "-j16" };
+
+	auto record = [&](json & r, uint64_t allocs) {
+		r["ns_per_call"] = r["seconds"].get<double>() * 1e9 / calls;
+		r["allocs_per_call"] = (double)allocs / calls;
+	};
+
+	uint64_t allocs = 0;
+	json & r_json = rn.run("status_json", "", "memory", [&] {
+		uint64_t start = g_allocations.load(std::memory_order_relaxed);
+		uint64_t bytes = 0;
+		for (size_t i = 0; i != calls; ++i)
+		{
+			json r = {
+				{ "id", id },
+				{ "command", cmd },
+				{ "exit_code", json() },
+				{ "pure", true },
+				{ "cached", false },
+			};
+			r["state"] = "running";
+			bytes += r.dump().size();
+		}
+		allocs = g_allocations.load(std::memory_order_relaxed) - start;
+		return bytes;
+	});
+	record(r_json, allocs);
+
+	proc_info pi;
+	pi.id = id;
+	pi.cmd = cmd;
+	pi.pure = true;
+	pi.proc.reset(new process());
+
+	json & r_writer = rn.run("status_writer", "", "memory", [&] {
+		uint64_t start = g_allocations.load(std::memory_order_relaxed);
+		uint64_t bytes = 0;
+		for (size_t i = 0; i != calls; ++i)
+			bytes += format_exec_status_locked(pi).size();
+		allocs = g_allocations.load(std::memory_order_relaxed) - start;
+		return bytes;
+	});
+	record(r_writer, allocs);
+}
+
+}
+
+int main(int argc, char * argv[])
+{
+	std::string tmpfs_dir = "/dev/shm";
+	std::string disk_dir = ".";
+	std::string label;
+	int scale = 1;
+	int repeat = 3;
+
+	parse_argv(argc, argv, {
+		{ tmpfs_dir, "--tmpfs-dir" },
+		{ disk_dir, "--disk-dir" },
+		{ label, "--label" },
+		{ scale, "--scale" },
+		{ repeat, "--repeat" },
+	});
+
+	runner rn;
+	rn.repeat = std::max(repeat, 1);
+
+	bench_format(rn);
+	bench_status(rn);
+
+	for (tree_spec const & spec : g_trees)
+	{
+		if (!tmpfs_dir.empty())
+			bench_tree(rn, spec, "tmpfs", tmpfs_dir, std::max(scale, 1), true);
+		if (!disk_dir.empty())
+			bench_tree(rn, spec, "disk", disk_dir, std::max(scale, 1), tmpfs_dir.empty());
+	}
+
+	json r = {
+		{ "label", label },
+		{ "scale", scale },
+		{ "results", std::move(rn.results) },
+	};
+	std::cout << r.dump(2) << "\n";
+}
@@ -0,0 +1,91 @@
+#include "blob_store.hpp"
+#include "file.hpp"
+#include "format.hpp"
+#include "guid.hpp"
+#include "hash.hpp"
+#include <cstdio>
+#include <memory>
+
+blob_store::blob_store(std::string root)
+	: root_(std::move(root))
+{
+	makedirs(root_);
+}
+
+bool blob_store::is_valid_hash(std::string_view hash)
+{
+	if (hash.size() != 64)
+		return false;
+
+	for (char ch : hash)
+	{
+		if ((ch < '0' || ch > '9') && (ch < 'a' || ch > 'f'))
+			return false;
+	}
+
+	return true;
+}
+
+std::string blob_store::path(std::string_view hash) const
+{
+	return join_paths(join_paths(root_, hash.substr(0, 2)), hash);
+}
+
+bool blob_store::contains(std::string_view hash)
+{
+	file fin;
+	std::error_code ec;
+	fin.open_ro(this->path(hash), ec);
+	return !ec;
+}
+
+bool blob_store::put(std::string_view hash, istream & in)
+{
+	std::string tmp = join_paths(root_, format(FMT("{}.tmp-{}"), hash, new_uuid()));
+
+	try
+	{
+		sha256 h;
+
+		{
+			file fout;
+			fout.create(tmp);
+
+			// Off the stack, which is small in a handler.
+			size_t const buf_size = 64 * 1024;
+			std::unique_ptr<char[]> buf(new char[buf_size]);
+			for (;;)
+			{
+				size_t r = in.read(buf.get(), buf_size);
+				if (r == 0)
+					break;
+
+				h.update(buf.get(), r);
+				fout.out_stream().write_all(buf.get(), r);
+			}
+		}
+
+		if (h.hexdigest() != hash)
+		{
+			std::remove(tmp.c_str());
+			return false;
+		}
+
+		makedirs(join_paths(root_, hash.substr(0, 2)));
+
+		// Fails if a concurrent upload got there first, which is fine.
+		if (std::rename(tmp.c_str(), this->path(hash).c_str()) != 0)
+			std::remove(tmp.c_str());
+		return true;
+	}
+	catch (...)
+	{
+		std::remove(tmp.c_str());
+		throw;
+	}
+}
+
+void blob_store::materialize(std::string_view hash, std::string_view dst, bool allow_hardlink)
+{
+	clone_file(this->path(hash), dst, allow_hardlink);
+}
@@ -0,0 +1,37 @@
+#ifndef BLOB_STORE_HPP
+#define BLOB_STORE_HPP
+
+#include "stream.hpp"
+#include <string>
+#include <string_view>
+
+// Files kept across sessions under the SHA-256 of their contents,
+// so that clients only need to upload what the agent hasn't seen yet.
+//
+// A blob lives at `<root>/<first two hex digits>/<hash>`. Blobs are
+// written aside and renamed into place once their hash is verified,
+// readers never see a partial one.
+struct blob_store
+{
+	explicit blob_store(std::string root);
+
+	// A lowercase hex SHA-256 digest.
+	static bool is_valid_hash(std::string_view hash);
+
+	bool contains(std::string_view hash);
+
+	// Stores the contents of `in` unless they hash to something else
+	// than `hash`, in which case nothing is stored and false is returned.
+	bool put(std::string_view hash, istream & in);
+
+	// Replaces `dst` with the blob, see `clone_file`.
+	// Throws if the blob isn't present.
+	void materialize(std::string_view hash, std::string_view dst, bool allow_hardlink);
+
+private:
+	std::string path(std::string_view hash) const;
+
+	std::string root_;
+};
+
+#endif // BLOB_STORE_HPP
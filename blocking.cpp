@@ -0,0 +1,248 @@
+#include "blocking.hpp"
+#include "server.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string.h>
+#include <thread>
+
+namespace {
+
+// Idle threads wait this long for more work before exiting.
+static auto const g_idle_timeout = std::chrono::seconds(30);
+
+struct thread_pool
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::function<void()>> queue;
+	size_t idle = 0;
+
+	// `fn` must not throw.
+	void submit(std::function<void()> fn)
+	{
+		bool spawn;
+
+		{
+			std::lock_guard<std::mutex> l(mutex);
+			queue.push_back(std::move(fn));
+			spawn = queue.size() > idle;
+		}
+
+		if (spawn)
+			std::thread([this] { this->run(); }).detach();
+		else
+			cv.notify_one();
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> l(mutex);
+		for (;;)
+		{
+			++idle;
+			bool ready = cv.wait_for(l, g_idle_timeout, [this] { return !queue.empty(); });
+			--idle;
+
+			if (!ready)
+				return;
+
+			auto fn = std::move(queue.front());
+			queue.pop_front();
+
+			l.unlock();
+			fn();
+			l.lock();
+		}
+	}
+};
+
+// Never destroyed, its threads may outlive `main`.
+thread_pool & g_pool()
+{
+	static thread_pool * pool = new thread_pool();
+	return *pool;
+}
+
+struct job
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool done = false;
+	std::exception_ptr error;
+
+	wakeup wake;
+};
+
+// The reader takes the writer's buffer as it is, the writer
+// is held up until it's all taken.
+struct chan_state final
+	: ostream
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	char const * data = nullptr;
+	size_t len = 0;
+	bool done = false;
+	bool closed = false;
+	std::exception_ptr error;
+
+	// Signaled whenever there is data or the writer is done.
+	wakeup wake;
+
+	size_t write(char const * buf, size_t n) override
+	{
+		if (n == 0)
+			return 0;
+
+		std::unique_lock<std::mutex> l(mutex);
+		if (closed)
+			throw std::runtime_error("epipe");
+
+		data = buf;
+		len = n;
+		wake.signal();
+
+		cv.wait(l, [this] { return len == 0 || closed; });
+		if (len != 0)
+			throw std::runtime_error("epipe");
+		return n;
+	}
+};
+
+struct blocking_chan final
+	: istream
+{
+	explicit blocking_chan(std::function<void(ostream & out)> fn)
+		: fn_(std::move(fn)), state_(std::make_shared<chan_state>()), started_(false)
+	{
+	}
+
+	~blocking_chan()
+	{
+		// The reader went away; the next write fails,
+		// which unwinds the writer's stack.
+		std::lock_guard<std::mutex> l(state_->mutex);
+		state_->closed = true;
+		state_->cv.notify_one();
+	}
+
+	size_t read(char * buf, size_t len) override
+	{
+		if (len == 0)
+			return 0;
+
+		chan_state & s = *state_;
+		if (!started_)
+		{
+			started_ = true;
+			g_pool().submit([state = state_, fn = std::move(fn_)] {
+				std::exception_ptr error;
+				try
+				{
+					fn(*state);
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				}
+
+				std::lock_guard<std::mutex> l(state->mutex);
+				state->done = true;
+				state->error = error;
+				state->wake.signal();
+			});
+		}
+
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> l(s.mutex);
+				if (s.len != 0)
+				{
+					size_t r = std::min(len, s.len);
+					memcpy(buf, s.data, r);
+					s.data += r;
+					s.len -= r;
+
+					if (s.len == 0)
+						s.cv.notify_one();
+					return r;
+				}
+
+				if (s.done)
+				{
+					if (s.error)
+						std::rethrow_exception(s.error);
+					return 0;
+				}
+			}
+
+			s.wake.wait();
+		}
+	}
+
+private:
+	std::function<void(ostream & out)> fn_;
+	std::shared_ptr<chan_state> state_;
+	bool started_;
+};
+
+}
+
+void run_blocking(std::function<void()> const & fn)
+{
+	auto j = std::make_shared<job>();
+	g_pool().submit([j, &fn] {
+		std::exception_ptr error;
+		try
+		{
+			fn();
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		std::lock_guard<std::mutex> l(j->mutex);
+		j->done = true;
+		j->error = error;
+		j->cv.notify_one();
+		j->wake.signal();
+	});
+
+	try
+	{
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> l(j->mutex);
+				if (j->done)
+					break;
+			}
+
+			j->wake.wait();
+		}
+	}
+	catch (...)
+	{
+		// The handler is being cancelled, but `fn` may refer
+		// to its stack, which mustn't unwind before `fn` is done.
+		std::unique_lock<std::mutex> l(j->mutex);
+		j->cv.wait(l, [&j] { return j->done; });
+		throw;
+	}
+
+	if (j->error)
+		std::rethrow_exception(j->error);
+}
+
+std::shared_ptr<istream> make_blocking_istream(std::function<void(ostream & out)> fn)
+{
+	auto px = std::make_shared<blocking_chan>(std::move(fn));
+	return std::shared_ptr<istream>(px, px.get());
+}
@@ -0,0 +1,23 @@
+#ifndef BLOCKING_HPP
+#define BLOCKING_HPP
+
+#include "stream.hpp"
+#include <functional>
+#include <memory>
+
+// Runs `fn` on a pool of threads kept for work that blocks, the disk
+// and child processes, and waits for it on a `wakeup`; within
+// `reactor_listen` the handler's worker serves other connections
+// meanwhile. Rethrows whatever `fn` threw.
+//
+// Socket reads and writes made from `fn` block its thread instead of
+// suspending a handler. The pool grows with the number of calls in
+// progress, threads that stay idle for a while exit.
+void run_blocking(std::function<void()> const & fn);
+
+// Like `make_istream`, but the writer runs on the pool above. It's
+// started by the first `read`, each write waits until the reader
+// has taken all of it.
+std::shared_ptr<istream> make_blocking_istream(std::function<void(ostream & out)> fn);
+
+#endif // BLOCKING_HPP
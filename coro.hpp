@@ -0,0 +1,37 @@
+#ifndef CORO_HPP
+#define CORO_HPP
+
+#include <functional>
+
+// A stackful coroutine.
+//
+// A suspended coroutine should be resumed on the thread it was
+// suspended on: the body's thread-local state, errno, OpenSSL's error
+// queue or an exception being handled, lives on that thread.
+struct coroutine
+{
+	explicit coroutine(std::function<void()> body);
+	~coroutine();
+	coroutine(coroutine const &) = delete;
+	coroutine & operator=(coroutine const &) = delete;
+
+	// Runs the body until it yields or returns. Exceptions escaping
+	// the body are rethrown here.
+	void resume();
+	bool done() const;
+
+	// Resumes a suspended body with `yield` throwing `operation_canceled`,
+	// and in every later `yield` too, so that its stack unwinds.
+	// Exceptions escaping the body are rethrown, as by `resume`.
+	void cancel();
+
+	// Suspends the running coroutine, its `resume` returns.
+	static void yield();
+	static bool in_coroutine();
+
+private:
+	struct impl;
+	impl * pimpl_;
+};
+
+#endif // CORO_HPP
@@ -0,0 +1,178 @@
+#include "deflate.hpp"
+#include <limits.h>
+#include <new>
+#include <stdexcept>
+#include <stdint.h>
+
+// zlib-ng has the same API as zlib under a `zng_` prefix; it picks
+// SIMD match finding, inflate window copies and the CRC32 variant
+// (PCLMULQDQ, ARMv8 CRC) at runtime.
+#ifdef AGENT_MAYBE_ZLIB_NG
+#include <zlib-ng.h>
+#define Z(name) zng_ ## name
+typedef zng_stream z_stream_t;
+#else
+#include <zlib.h>
+#define Z(name) name
+typedef z_stream z_stream_t;
+#endif
+
+// Selects the gzip wrapper in deflateInit2/inflateInit2.
+static int const g_gzip_window_bits = 15 + 16;
+
+struct deflate_filter::impl
+{
+	z_stream_t strm;
+	bool compress;
+
+	// Inflate has reached the end of a gzip member.
+	bool member_end = false;
+
+	// Zeros follow the last member, as tar and dd leave when padding
+	// to a block size. Nothing else may come after them.
+	bool padding = false;
+};
+
+deflate_filter::deflate_filter(bool compress, int level)
+	: pimpl_(new impl())
+{
+	pimpl_->compress = compress;
+
+	int r = compress
+		? Z(deflateInit2)(&pimpl_->strm, level, Z_DEFLATED, g_gzip_window_bits, 8, Z_DEFAULT_STRATEGY)
+		: Z(inflateInit2)(&pimpl_->strm, g_gzip_window_bits);
+	if (r != Z_OK)
+	{
+		delete pimpl_;
+		throw std::bad_alloc();
+	}
+}
+
+deflate_filter::~deflate_filter()
+{
+	if (pimpl_->compress)
+		Z(deflateEnd)(&pimpl_->strm);
+	else
+		Z(inflateEnd)(&pimpl_->strm);
+	delete pimpl_;
+}
+
+std::pair<size_t, size_t> deflate_filter::process(char const * in, size_t in_len, char * out, size_t out_len)
+{
+	// The lengths are 32-bit in zlib; the callers loop anyway.
+	if (in_len > UINT_MAX)
+		in_len = UINT_MAX;
+	if (out_len > UINT_MAX)
+		out_len = UINT_MAX;
+
+	z_stream_t & s = pimpl_->strm;
+
+	// Concatenated gzip members inflate to the concatenation of their
+	// contents, as with gzip -d, and trailing zeros are ignored, since no
+	// member starts with one; anything else after a member is corrupt.
+	if (pimpl_->member_end && in_len != 0)
+	{
+		if (in[0] == 0)
+			pimpl_->padding = true;
+
+		if (pimpl_->padding)
+		{
+			for (size_t i = 0; i != in_len; ++i)
+			{
+				if (in[i] != 0)
+					throw std::runtime_error("corrupt gzip stream");
+			}
+			return { in_len, 0 };
+		}
+
+		Z(inflateReset)(&s);
+		pimpl_->member_end = false;
+	}
+
+	s.next_in = (unsigned char *)in;
+	s.avail_in = (unsigned)in_len;
+	s.next_out = (unsigned char *)out;
+	s.avail_out = (unsigned)out_len;
+
+	int r = pimpl_->compress? Z(deflate)(&s, Z_NO_FLUSH): Z(inflate)(&s, Z_NO_FLUSH);
+	if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+		throw std::runtime_error(pimpl_->compress? "deflate failed": "corrupt gzip stream");
+
+	if (r == Z_STREAM_END && !pimpl_->compress)
+		pimpl_->member_end = true;
+
+	return { in_len - s.avail_in, out_len - s.avail_out };
+}
+
+size_t deflate_filter::finish(char * out, size_t out_len)
+{
+	if (out_len > UINT_MAX)
+		out_len = UINT_MAX;
+
+	z_stream_t & s = pimpl_->strm;
+	s.next_in = nullptr;
+	s.avail_in = 0;
+	s.next_out = (unsigned char *)out;
+	s.avail_out = (unsigned)out_len;
+
+	int r = pimpl_->compress? Z(deflate)(&s, Z_FINISH): Z(inflate)(&s, Z_FINISH);
+	if (r == Z_STREAM_END || r == Z_OK)
+		return out_len - s.avail_out;
+
+	if (r == Z_BUF_ERROR && !pimpl_->compress)
+	{
+		// Inflate has nothing more to give without more input.
+		if (out_len != s.avail_out)
+			return out_len - s.avail_out;
+		throw std::runtime_error("truncated gzip stream");
+	}
+
+	throw std::runtime_error(pimpl_->compress? "deflate failed": "corrupt gzip stream");
+}
+
+char const * deflate_filter::backend()
+{
+#ifdef AGENT_MAYBE_ZLIB_NG
+	return "zlib-ng";
+#else
+	return "zlib";
+#endif
+}
+
+bool gunzip_buffer(std::string_view in, std::string & out, size_t max_size)
+{
+	// A gzip member is at least a 10-byte header and an 8-byte trailer.
+	if (in.size() < 18)
+		return false;
+
+	// The trailer ends with the size modulo 2^32; for a single member
+	// it's exact unless the content is over 4 GB, which `max_size` rules out.
+	unsigned char const * trailer = (unsigned char const *)in.data() + in.size() - 4;
+	size_t size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+	if (size > max_size || in.size() > UINT_MAX)
+		return false;
+
+	// The extra byte tells a second member or garbage after the first one
+	// apart from the end of the output.
+	out.resize(size + 1);
+
+	z_stream_t s = {};
+	if (Z(inflateInit2)(&s, g_gzip_window_bits) != Z_OK)
+		throw std::bad_alloc();
+
+	s.next_in = (unsigned char *)in.data();
+	s.avail_in = (unsigned)in.size();
+	s.next_out = (unsigned char *)&out[0];
+	s.avail_out = (unsigned)out.size();
+
+	int r = Z(inflate)(&s, Z_FINISH);
+	size_t produced = out.size() - s.avail_out;
+	bool complete = r == Z_STREAM_END && s.avail_in == 0;
+	Z(inflateEnd)(&s);
+
+	if (!complete || produced != size)
+		return false;
+
+	out.resize(size);
+	return true;
+}
@@ -0,0 +1,39 @@
+#ifndef DEFLATE_HPP
+#define DEFLATE_HPP
+
+#include <string>
+#include <string_view>
+#include <utility>
+
+// A gzip filter for `filter_reader` and `filter_writer`, with the same
+// interface as `gzip_filter`. The deflate implementation is chosen when
+// the agent is configured, see AGENT_MAYBE_DEFLATE in CMakeLists.txt.
+struct deflate_filter
+{
+	explicit deflate_filter(bool compress, int level = 6);
+	~deflate_filter();
+	deflate_filter(deflate_filter const &) = delete;
+	deflate_filter & operator=(deflate_filter const &) = delete;
+
+	// Returns the number of bytes consumed from `in` and produced into `out`.
+	std::pair<size_t, size_t> process(char const * in, size_t in_len, char * out, size_t out_len);
+
+	// Flushes the rest of the output, returns 0 once there is nothing left.
+	size_t finish(char * out, size_t out_len);
+
+	// The name of the implementation, for diagnostics.
+	static char const * backend();
+
+private:
+	struct impl;
+	impl * pimpl_;
+};
+
+// Inflates a complete gzip stream held in memory in one call, which spares
+// the per-call overhead of streaming. The output is sized from the trailer.
+// Returns false, leaving `out` unspecified, if the stream has more than one
+// member, inflates to more than `max_size` bytes, or is corrupt; the caller
+// is expected to fall back to streaming, which reports errors properly.
+bool gunzip_buffer(std::string_view in, std::string & out, size_t max_size);
+
+#endif // DEFLATE_HPP
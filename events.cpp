@@ -0,0 +1,147 @@
+#include "events.hpp"
+#include "format.hpp"
+#include "server.hpp"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+
+struct event_bus::subscriber final
+	: istream
+{
+	std::mutex mutex;
+	std::string buf;
+	size_t pos = 0;
+	bool dropped = false;
+
+	// Only dereferenced by the reader.
+	socket_stream * sock = nullptr;
+
+	// Signaled whenever `buf` grows or the subscriber is dropped.
+	wakeup wake;
+
+	size_t read(char * out, size_t len) override
+	{
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> l(mutex);
+				if (pos != buf.size())
+				{
+					size_t n = std::min(len, buf.size() - pos);
+					memcpy(out, buf.data() + pos, n);
+					pos += n;
+
+					if (pos == buf.size())
+					{
+						buf.clear();
+						pos = 0;
+					}
+
+					return n;
+				}
+
+				if (dropped)
+					return 0;
+			}
+
+			// Nothing is read from the socket, the client isn't
+			// expected to say anything more.
+			if (sock && sock->peer_closed())
+			{
+				std::lock_guard<std::mutex> l(mutex);
+				dropped = true;
+				return 0;
+			}
+
+			wake.wait();
+		}
+	}
+};
+
+event_bus::event_bus()
+	: stopping_(false)
+{
+	heartbeat_ = std::thread([this] { this->heartbeat_loop(); });
+}
+
+event_bus::~event_bus()
+{
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		stopping_ = true;
+	}
+
+	stop_cv_.notify_all();
+	heartbeat_.join();
+}
+
+void event_bus::publish(std::string_view type, std::string_view data)
+{
+	std::string ev = format(FMT("event: {}\ndata: {}\n\n"), type, data);
+
+	std::lock_guard<std::mutex> l(mutex_);
+	for (auto it = subscribers_.begin(); it != subscribers_.end(); )
+	{
+		auto sub = it->lock();
+		if (!sub)
+		{
+			it = subscribers_.erase(it);
+			continue;
+		}
+
+		{
+			std::lock_guard<std::mutex> sl(sub->mutex);
+			if (sub->buf.size() - sub->pos + ev.size() > max_backlog)
+				sub->dropped = true;
+			else
+				sub->buf.append(ev);
+		}
+
+		sub->wake.signal();
+
+		if (sub->dropped)
+			it = subscribers_.erase(it);
+		else
+			++it;
+	}
+}
+
+std::shared_ptr<istream> event_bus::subscribe(std::string_view type, std::string_view data, socket_stream * sock)
+{
+	auto sub = std::make_shared<subscriber>();
+	sub->buf = format(FMT("event: {}\ndata: {}\n\n"), type, data);
+	sub->sock = sock;
+
+	std::lock_guard<std::mutex> l(mutex_);
+	subscribers_.push_back(sub);
+	return sub;
+}
+
+void event_bus::heartbeat_loop()
+{
+	std::unique_lock<std::mutex> l(mutex_);
+	for (int tick = 1; !stop_cv_.wait_for(l, std::chrono::seconds(liveness_interval), [this] { return stopping_; }); ++tick)
+	{
+		bool heartbeat = tick % (heartbeat_interval / liveness_interval) == 0;
+		for (auto && s : subscribers_)
+		{
+			auto sub = s.lock();
+			if (!sub)
+				continue;
+
+			// A wakeup with nothing to read has the subscriber check its socket.
+			if (heartbeat)
+			{
+				std::lock_guard<std::mutex> sl(sub->mutex);
+				if (sub->pos == sub->buf.size())
+					sub->buf.append(": keepalive\n\n");
+			}
+			else if (!sub->sock)
+			{
+				continue;
+			}
+
+			sub->wake.signal();
+		}
+	}
+}
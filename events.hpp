@@ -0,0 +1,59 @@
+#ifndef EVENTS_HPP
+#define EVENTS_HPP
+
+#include "stream.hpp"
+#include "server.hpp"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Fans the agent's state changes out to subscribers as server-sent events.
+//
+//     event: exec
+//     data: {"cached":false,"command":["make"],...,"state":"exited"}
+//
+// Every subscriber has a buffer of its own; one that falls more than
+// `max_backlog` bytes behind is disconnected rather than holding up
+// the publisher. Idle subscribers get a comment line every
+// `heartbeat_interval` seconds, so that proxies keep the stream open.
+//
+// A subscriber given its socket checks every `liveness_interval`
+// seconds whether the client has closed the connection, and ends
+// the stream if so. Others end once writing to it fails.
+struct event_bus
+{
+	static constexpr size_t max_backlog = 1024 * 1024;
+	static constexpr int heartbeat_interval = 15;
+	static constexpr int liveness_interval = 1;
+
+	event_bus();
+	~event_bus();
+	event_bus(event_bus const &) = delete;
+	event_bus & operator=(event_bus const &) = delete;
+
+	// `data` must be a single line, which JSON without indentation is.
+	void publish(std::string_view type, std::string_view data);
+
+	// The stream starts with the given event, a snapshot of the state
+	// that the following events change, and ends once the subscriber
+	// is dropped. `sock` is the connection the stream is read for,
+	// if known; it must outlive the stream.
+	std::shared_ptr<istream> subscribe(std::string_view type, std::string_view data, socket_stream * sock = nullptr);
+
+private:
+	struct subscriber;
+
+	void heartbeat_loop();
+
+	std::mutex mutex_;
+	std::vector<std::weak_ptr<subscriber>> subscribers_;
+
+	std::condition_variable stop_cv_;
+	bool stopping_;
+	std::thread heartbeat_;
+};
+
+#endif // EVENTS_HPP
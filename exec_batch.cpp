@@ -0,0 +1,233 @@
+#include "exec_batch.hpp"
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+namespace {
+
+// Nodes of all batches, of all workspaces, share these.
+struct job_slots
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	size_t total;
+	size_t free;
+
+	job_slots()
+	{
+		total = std::thread::hardware_concurrency();
+		if (total == 0)
+			total = 1;
+		free = total;
+	}
+
+	void acquire()
+	{
+		std::unique_lock<std::mutex> l(mutex);
+		cv.wait(l, [this] { return free != 0; });
+		--free;
+	}
+
+	void release()
+	{
+		{
+			std::lock_guard<std::mutex> l(mutex);
+			++free;
+		}
+
+		cv.notify_one();
+	}
+};
+
+job_slots g_job_slots;
+
+struct batch
+{
+	struct node
+	{
+		std::shared_ptr<proc_info> pi;
+		std::vector<size_t> dependents;
+		size_t pending_deps;
+		bool started;
+	};
+
+	std::mutex mutex;
+	std::condition_variable cv;
+
+	std::vector<node> nodes;
+	std::deque<size_t> ready;
+	process_options opts;
+
+	// Nodes that are either waiting or running.
+	size_t remaining;
+	bool failed;
+
+	void skip_rest()
+	{
+		ready.clear();
+		for (auto && n : nodes)
+		{
+			if (n.started)
+				continue;
+
+			n.started = true;
+			--remaining;
+
+			std::lock_guard<std::mutex> l(n.pi->mutex);
+			n.pi->skipped = true;
+			finish_exec_locked(*n.pi, 0);
+		}
+	}
+
+	void run_one(size_t idx)
+	{
+		proc_info & pi = *nodes[idx].pi;
+
+		bool ok;
+		try
+		{
+			auto proc = std::make_unique<process>();
+			proc->start(pi.cmd, opts);
+
+			process * p = proc.get();
+			{
+				std::lock_guard<std::mutex> l(pi.mutex);
+				start_exec_locked(pi, std::move(proc));
+			}
+
+			p->wait();
+			poll_exec(pi);
+			ok = pi.exit_code == 0;
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> l(pi.mutex);
+			finish_exec_locked(pi, -1);
+			ok = false;
+		}
+
+		std::lock_guard<std::mutex> l(mutex);
+		--remaining;
+
+		if (!ok)
+		{
+			failed = true;
+			this->skip_rest();
+		}
+		else if (!failed)
+		{
+			for (size_t dep : nodes[idx].dependents)
+			{
+				if (--nodes[dep].pending_deps == 0)
+					ready.push_back(dep);
+			}
+		}
+
+		cv.notify_all();
+	}
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> l(mutex);
+		for (;;)
+		{
+			cv.wait(l, [this] { return !ready.empty() || remaining == 0; });
+			if (ready.empty())
+				return;
+
+			l.unlock();
+			g_job_slots.acquire();
+			l.lock();
+
+			// Another worker of the batch may have been quicker.
+			if (ready.empty())
+			{
+				g_job_slots.release();
+				continue;
+			}
+
+			size_t idx = ready.front();
+			ready.pop_front();
+			nodes[idx].started = true;
+
+			l.unlock();
+			this->run_one(idx);
+			g_job_slots.release();
+			l.lock();
+		}
+	}
+};
+
+}
+
+bool has_cycle(std::vector<exec_batch_node> const & nodes)
+{
+	// Kahn's algorithm; whatever can't be ordered is on a cycle.
+	std::vector<size_t> pending(nodes.size());
+	std::vector<std::vector<size_t>> dependents(nodes.size());
+	for (size_t i = 0; i != nodes.size(); ++i)
+	{
+		pending[i] = nodes[i].deps.size();
+		for (size_t dep : nodes[i].deps)
+			dependents[dep].push_back(i);
+	}
+
+	std::vector<size_t> ready;
+	for (size_t i = 0; i != nodes.size(); ++i)
+	{
+		if (pending[i] == 0)
+			ready.push_back(i);
+	}
+
+	size_t ordered = 0;
+	while (!ready.empty())
+	{
+		size_t idx = ready.back();
+		ready.pop_back();
+		++ordered;
+
+		for (size_t d : dependents[idx])
+		{
+			if (--pending[d] == 0)
+				ready.push_back(d);
+		}
+	}
+
+	return ordered != nodes.size();
+}
+
+void start_exec_batch(std::vector<exec_batch_node> nodes, size_t jobs, process_options const & opts)
+{
+	assert(!has_cycle(nodes));
+
+	auto b = std::make_shared<batch>();
+	b->remaining = nodes.size();
+	b->failed = false;
+	b->opts = opts;
+
+	b->nodes.resize(nodes.size());
+	for (size_t i = 0; i != nodes.size(); ++i)
+	{
+		auto & n = b->nodes[i];
+		n.pi = std::move(nodes[i].pi);
+		n.pending_deps = nodes[i].deps.size();
+		n.started = false;
+
+		for (size_t dep : nodes[i].deps)
+			b->nodes[dep].dependents.push_back(i);
+
+		if (n.pending_deps == 0)
+			b->ready.push_back(i);
+	}
+
+	if (jobs == 0)
+		jobs = 1;
+	if (jobs > g_job_slots.total)
+		jobs = g_job_slots.total;
+	if (jobs > nodes.size())
+		jobs = nodes.size();
+
+	for (size_t i = 0; i != jobs; ++i)
+		std::thread([b] { b->worker(); }).detach();
+}
@@ -0,0 +1,27 @@
+#ifndef EXEC_BATCH_HPP
+#define EXEC_BATCH_HPP
+
+#include "exec_registry.hpp"
+#include <memory>
+#include <vector>
+
+struct exec_batch_node
+{
+	// Registered, but not yet started.
+	std::shared_ptr<proc_info> pi;
+
+	// Indices of the nodes that must exit successfully first.
+	std::vector<size_t> deps;
+};
+
+bool has_cycle(std::vector<exec_batch_node> const & nodes);
+
+// Runs the graph in the background, at most `jobs` nodes at a time.
+// However many batches run, no more nodes than there are hardware
+// threads run at once, `jobs` is capped at that, too.
+// A node starts as soon as all of its dependencies have exited with 0.
+// Once any node fails, nodes that haven't started yet are skipped.
+// Every node is started with `opts`.
+void start_exec_batch(std::vector<exec_batch_node> nodes, size_t jobs, process_options const & opts);
+
+#endif // EXEC_BATCH_HPP
@@ -0,0 +1,298 @@
+#include "exec_cache.hpp"
+#include "file.hpp"
+#include "format.hpp"
+#include "guid.hpp"
+#include "hash.hpp"
+#include "process.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+
+#include <json.hpp>
+using nlohmann::json;
+
+// Returns the number of bytes copied.
+static uint64_t copy_file(std::string const & src, std::string const & dst)
+{
+	file fin;
+	fin.open_ro(src);
+
+	// Replaces rather than truncates, `dst` may be a hard link, into
+	// the blob store for one, whose other names must keep their contents.
+	std::remove(dst.c_str());
+
+	file fout;
+	fout.create(dst);
+	copy(fout.out_stream(), fin.in_stream());
+	return fin.size();
+}
+
+static void make_parent_dirs(std::string const & path)
+{
+	size_t sep = path.find_last_of("/\\");
+	if (sep != std::string::npos && sep != 0)
+		makedirs(std::string_view(path).substr(0, sep));
+}
+
+exec_cache::exec_cache(std::string root, uint64_t max_size)
+	: root_(std::move(root)), max_size_(max_size), size_(0)
+{
+	struct found
+	{
+		uint64_t size = 0;
+		uint64_t mtime = 0;
+		bool complete = false;
+	};
+
+	std::map<std::string, found> on_disk;
+	enum_files(root_, [this, &on_disk](std::string_view fname) {
+		size_t sep = fname.find_first_of("/\\");
+		if (sep == std::string_view::npos)
+			return;
+
+		file f;
+		std::error_code ec;
+		f.open_ro(join_paths(root_, fname), ec);
+		if (ec)
+			return;
+
+		found & e = on_disk[std::string(fname.substr(0, sep))];
+		e.size += f.size();
+		if (fname.substr(sep + 1) == "status.json")
+		{
+			e.mtime = f.mtime();
+			e.complete = true;
+		}
+	});
+
+	std::vector<std::pair<uint64_t, std::string>> by_age;
+	std::vector<std::string> stale;
+	for (auto && kv : on_disk)
+	{
+		// Assembled by a store that never finished.
+		if (!kv.second.complete || kv.first.find(".tmp-") != std::string::npos)
+			stale.push_back(kv.first);
+		else
+			by_age.emplace_back(kv.second.mtime, kv.first);
+	}
+
+	std::sort(by_age.begin(), by_age.end());
+	{
+		std::lock_guard<std::mutex> l(mutex_);
+		for (auto && e : by_age)
+		{
+			auto evicted = this->insert_locked(e.second, on_disk[e.second].size);
+			stale.insert(stale.end(), evicted.begin(), evicted.end());
+		}
+	}
+
+	this->remove(stale);
+}
+
+void exec_cache::touch(std::string const & key)
+{
+	std::lock_guard<std::mutex> l(mutex_);
+
+	auto it = entries_.find(key);
+	if (it != entries_.end())
+		lru_.splice(lru_.begin(), lru_, it->second.lru);
+}
+
+std::vector<std::string> exec_cache::insert_locked(std::string const & key, uint64_t size)
+{
+	std::vector<std::string> evicted;
+	if (entries_.find(key) != entries_.end())
+		return evicted;
+
+	lru_.push_front(key);
+	entries_.emplace(key, entry{ size, lru_.begin() });
+	size_ += size;
+
+	// The entry just added stays even if it alone is over the limit.
+	while (size_ > max_size_ && lru_.size() > 1)
+	{
+		auto it = entries_.find(lru_.back());
+		size_ -= it->second.size;
+		evicted.push_back(lru_.back());
+		entries_.erase(it);
+		lru_.pop_back();
+	}
+
+	return evicted;
+}
+
+void exec_cache::remove(std::vector<std::string> const & keys)
+{
+	for (auto && key : keys)
+	{
+		std::error_code ec;
+		rmtree(join_paths(root_, key), ec);
+	}
+}
+
+std::string exec_cache::key(std::vector<std::string> const & cmd, std::string_view workspace, std::string_view cwd,
+	std::vector<std::string> const & inputs, std::vector<std::string> const & outputs)
+{
+	sha256 h;
+
+	// Every item is NUL-terminated, so that adjacent items can't run together.
+	auto add = [&h](std::string_view item) {
+		h.update(item);
+		h.update(std::string_view("", 1));
+	};
+
+	add("cmd");
+	for (auto && arg : cmd)
+		add(arg);
+
+	std::vector<std::string> env = get_environment();
+	std::sort(env.begin(), env.end());
+
+	add("env");
+	for (auto && var : env)
+		add(var);
+
+	add("dirs");
+	add(workspace);
+	add(cwd);
+
+	add("outputs");
+	for (auto && path : outputs)
+		add(path);
+
+	add("inputs");
+	for (auto && path : inputs)
+	{
+		add(path);
+
+		std::string full_path = join_paths(workspace, path);
+
+		file fin;
+		std::error_code ec;
+		fin.open_ro(full_path, ec);
+		if (ec)
+		{
+			add("-");
+			continue;
+		}
+
+		sha256 content;
+		content.update(fin.in_stream());
+		add(content.hexdigest());
+	}
+
+	return h.hexdigest();
+}
+
+bool exec_cache::restore(std::string const & key, std::string_view workspace,
+	std::vector<std::string> const & outputs, std::string const & output_file, int32_t & exit_code)
+{
+	std::string dir = join_paths(root_, key);
+
+	file fin;
+	std::error_code ec;
+	fin.open_ro(join_paths(dir, "status.json"), ec);
+	if (ec)
+		return false;
+
+	json j = json::parse(fin.in_stream().read_all());
+
+	auto present = j.find("outputs");
+	if (present == j.end() || !present->is_array() || present->size() != outputs.size())
+		return false;
+
+	try
+	{
+		for (size_t i = 0; i != outputs.size(); ++i)
+		{
+			if (!(*present)[i].get<bool>())
+				continue;
+
+			std::string dst = join_paths(workspace, outputs[i]);
+			make_parent_dirs(dst);
+			copy_file(join_paths(dir, format(FMT("{}"), i)), dst);
+		}
+
+		copy_file(join_paths(dir, "output"), output_file);
+	}
+	catch (std::system_error const &)
+	{
+		// Evicted meanwhile; the execution runs after all and
+		// replaces whatever was restored.
+		return false;
+	}
+
+	exit_code = j["exit_code"].get<int32_t>();
+	this->touch(key);
+	return true;
+}
+
+void exec_cache::store(std::string const & key, std::string_view workspace,
+	std::vector<std::string> const & outputs, std::string const & output_file, int32_t exit_code)
+{
+	// Entries are assembled aside and renamed into place,
+	// readers never see a partial one.
+	std::string tmp = join_paths(root_, format(FMT("{}.tmp-{}"), key, new_uuid()));
+	makedirs(tmp);
+
+	try
+	{
+		uint64_t size = 0;
+
+		json present = json::array();
+		for (size_t i = 0; i != outputs.size(); ++i)
+		{
+			std::string src = join_paths(workspace, outputs[i]);
+
+			file fin;
+			std::error_code ec;
+			fin.open_ro(src, ec);
+			present.push_back(!ec);
+
+			if (!ec)
+			{
+				file fout;
+				fout.create(join_paths(tmp, format(FMT("{}"), i)));
+				copy(fout.out_stream(), fin.in_stream());
+				size += fin.size();
+			}
+		}
+
+		size += copy_file(output_file, join_paths(tmp, "output"));
+
+		json j = {
+			{ "exit_code", exit_code },
+			{ "outputs", present },
+		};
+
+		std::string status = j.dump();
+		size += status.size();
+
+		file fout;
+		fout.create(join_paths(tmp, "status.json"));
+		fout.out_stream().write_all(status);
+		fout.close();
+
+		// Fails if a concurrent execution got there first, which is fine.
+		if (std::rename(tmp.c_str(), join_paths(root_, key).c_str()) == 0)
+		{
+			std::vector<std::string> evicted;
+			{
+				std::lock_guard<std::mutex> l(mutex_);
+				evicted = this->insert_locked(key, size);
+			}
+
+			this->remove(evicted);
+			return;
+		}
+	}
+	catch (...)
+	{
+		std::error_code ec;
+		rmtree(tmp, ec);
+		throw;
+	}
+
+	std::error_code ec;
+	rmtree(tmp, ec);
+}
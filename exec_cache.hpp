@@ -0,0 +1,63 @@
+#ifndef EXEC_CACHE_HPP
+#define EXEC_CACHE_HPP
+
+#include <list>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Memoizes the results of pure executions.
+//
+// An entry is keyed by the command, the environment the agent passes
+// to its children, the workspace and working directory it runs in,
+// and the contents of the input files the command declares. It holds
+// the exit code, the captured output and the declared output files,
+// each stored in a directory of its own under `root`.
+//
+// Once the entries take more than `max_size` bytes, the least recently
+// used ones are evicted. Entries left by an earlier run count as used
+// when they were stored.
+struct exec_cache
+{
+	exec_cache(std::string root, uint64_t max_size);
+
+	// Paths of inputs and outputs are relative to the workspace.
+	std::string key(std::vector<std::string> const & cmd, std::string_view workspace, std::string_view cwd,
+		std::vector<std::string> const & inputs, std::vector<std::string> const & outputs);
+
+	// On a hit, copies the output files into the workspace
+	// and the captured output into `output_file`.
+	bool restore(std::string const & key, std::string_view workspace,
+		std::vector<std::string> const & outputs, std::string const & output_file, int32_t & exit_code);
+
+	void store(std::string const & key, std::string_view workspace,
+		std::vector<std::string> const & outputs, std::string const & output_file, int32_t exit_code);
+
+private:
+	struct entry
+	{
+		uint64_t size;
+		std::list<std::string>::iterator lru;
+	};
+
+	std::string root_;
+	uint64_t max_size_;
+
+	std::mutex mutex_;
+	uint64_t size_;
+	std::unordered_map<std::string, entry> entries_;
+
+	// Keys, the most recently used first.
+	std::list<std::string> lru_;
+
+	void touch(std::string const & key);
+
+	// Returns the keys of the entries to remove, the caller holds `mutex_`.
+	std::vector<std::string> insert_locked(std::string const & key, uint64_t size);
+	void remove(std::vector<std::string> const & keys);
+};
+
+#endif // EXEC_CACHE_HPP
@@ -0,0 +1,237 @@
+#include "exec_registry.hpp"
+#include "format.hpp"
+#include "json_writer.hpp"
+#include <cstdio>
+#include <stdexcept>
+
+static bool poll_locked(proc_info & pi)
+{
+	if (pi.finished || !pi.proc || pi.has_waiter || !pi.proc->poll())
+		return pi.finished;
+
+	finish_exec_locked(pi, pi.proc->exit_code());
+	return true;
+}
+
+bool poll_exec(proc_info & pi)
+{
+	std::lock_guard<std::mutex> l(pi.mutex);
+	return poll_locked(pi);
+}
+
+std::string format_exec_status(proc_info & pi)
+{
+	std::lock_guard<std::mutex> l(pi.mutex);
+	poll_locked(pi);
+	return format_exec_status_locked(pi);
+}
+
+std::string format_exec_status_locked(proc_info const & pi)
+{
+	char const * state;
+	if (pi.skipped)
+		state = "skipped";
+	else if (pi.finished)
+		state = "exited";
+	else
+		state = pi.proc? "running": "pending";
+
+	size_t size_hint = 96;
+	for (auto && arg : pi.cmd)
+		size_hint += arg.size() + 3;
+
+	std::string r;
+	r.reserve(size_hint);
+
+	// Keys are in the order nlohmann::json used to sort them.
+	json_writer w(r);
+	w.begin_object();
+	w.key("cached").value(pi.cached);
+	w.key("command").begin_array();
+	for (auto && arg : pi.cmd)
+		w.value(arg);
+	w.end_array();
+	w.key("exit_code");
+	if (pi.finished && !pi.skipped)
+		w.value(pi.exit_code);
+	else
+		w.null();
+	w.key("id").value(pi.id);
+	w.key("pure").value(pi.pure);
+	w.key("state").value(state);
+	w.end_object();
+	return r;
+}
+
+void start_exec_locked(proc_info & pi, std::unique_ptr<process> proc)
+{
+	if (pi.registry && !pi.finished)
+	{
+		--pi.registry->pending_;
+		++pi.registry->running_;
+	}
+
+	pi.proc = std::move(proc);
+}
+
+void finish_exec_locked(proc_info & pi, int32_t exit_code)
+{
+	if (pi.registry && !pi.finished)
+		--(pi.proc? pi.registry->running_: pi.registry->pending_);
+
+	bool was_finished = pi.finished;
+	pi.finished = true;
+	pi.exit_code = exit_code;
+
+	if (pi.registry && !was_finished)
+		pi.registry->on_finished(pi);
+
+	if (pi.on_exit)
+	{
+		auto on_exit = std::move(pi.on_exit);
+		on_exit(pi);
+	}
+}
+
+exec_registry::exec_registry(std::string history_dir, size_t max_live, size_t max_history)
+	: next_id_(0), max_live_per_shard_((max_live + shard_count - 1) / shard_count), running_(0), pending_(0),
+	history_dir_(std::move(history_dir)), max_history_(max_history)
+{
+}
+
+size_t exec_registry::add(std::shared_ptr<proc_info> pi)
+{
+	size_t id = next_id_++;
+	shard & s = shards_[id % shard_count];
+
+	// The entry is in the shard before anyone holding its mutex can see
+	// `registry` set, and thus before `on_finished` can look for it.
+	std::vector<std::shared_ptr<proc_info>> retired;
+	{
+		std::lock_guard<std::mutex> pl(pi->mutex);
+		pi->id = id;
+		pi->registry = this;
+		if (!pi->finished)
+			++(pi->proc? running_: pending_);
+
+		std::lock_guard<std::mutex> l(s.mutex);
+		s.live.emplace(id, pi);
+		if (pi->finished)
+			s.finished.push_back(id);
+
+		while (s.live.size() - s.retiring > max_live_per_shard_ && !s.finished.empty())
+		{
+			retired.push_back(s.live.at(s.finished.front()));
+			s.finished.pop_front();
+			++s.retiring;
+		}
+	}
+
+	if (retired.empty())
+		return id;
+
+	// The history is written before the entries leave the shard,
+	// so that a concurrent lookup finds them in one or the other.
+	this->write_history(retired);
+
+	{
+		std::lock_guard<std::mutex> l(s.mutex);
+		for (auto && e : retired)
+			s.live.erase(e->id);
+		s.retiring -= retired.size();
+	}
+
+	// Only live entries serve their output.
+	for (auto && e : retired)
+	{
+		if (!e->output_file.empty())
+			std::remove(e->output_file.c_str());
+	}
+
+	return id;
+}
+
+void exec_registry::on_finished(proc_info const & pi)
+{
+	shard & s = shards_[pi.id % shard_count];
+
+	std::lock_guard<std::mutex> l(s.mutex);
+	s.finished.push_back(pi.id);
+}
+
+std::shared_ptr<proc_info> exec_registry::find(size_t id)
+{
+	shard & s = shards_[id % shard_count];
+
+	std::lock_guard<std::mutex> l(s.mutex);
+	auto it = s.live.find(id);
+	return it == s.live.end()? nullptr: it->second;
+}
+
+void exec_registry::count_live(size_t & running, size_t & pending)
+{
+	running = running_.load();
+	pending = pending_.load();
+}
+
+void exec_registry::write_history(std::vector<std::shared_ptr<proc_info>> const & retired)
+{
+	// Finished entries no longer change, their records can be made
+	// without their mutexes.
+	std::string lines;
+	std::vector<std::pair<size_t, size_t>> records;
+	for (auto && pi : retired)
+	{
+		format_to(lines, FMT("{} "), pi->id);
+		size_t offset = lines.size();
+		lines.append(format_exec_status_locked(*pi));
+		records.emplace_back(offset, lines.size() - offset);
+		lines.append("\n");
+	}
+
+	std::lock_guard<std::mutex> l(history_mutex_);
+
+	if (history_.index.size() >= max_history_)
+	{
+		prev_history_ = std::move(history_);
+		history_ = history_file();
+	}
+
+	if (history_.index.empty())
+		history_.f.create_temporary(history_dir_);
+
+	history_.f.out_stream().write_all(lines);
+
+	for (size_t i = 0; i != retired.size(); ++i)
+		history_.index[retired[i]->id] = { history_.size + records[i].first, records[i].second };
+	history_.size += lines.size();
+}
+
+bool exec_registry::find_retired(size_t id, std::string & record)
+{
+	if (id >= next_id_)
+		return false;
+
+	std::lock_guard<std::mutex> l(history_mutex_);
+
+	for (history_file * h : { &history_, &prev_history_ })
+	{
+		auto it = h->index.find(id);
+		if (it == h->index.end())
+			continue;
+
+		record.resize(it->second.second);
+		size_t done = 0;
+		while (done < record.size())
+		{
+			size_t r = h->f.read_at(it->second.first + done, &record[done], record.size() - done);
+			if (r == 0)
+				throw std::runtime_error("truncated exec history");
+			done += r;
+		}
+
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,144 @@
+#ifndef EXEC_REGISTRY_HPP
+#define EXEC_REGISTRY_HPP
+
+#include "file.hpp"
+#include "process.hpp"
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct exec_registry;
+
+struct proc_info
+{
+	size_t id;
+	std::vector<std::string> cmd;
+	bool pure;
+	std::unique_ptr<process> proc;
+
+	// Set while the child's stdin pipe waits to be fed by POST /exec/<id>/stdin.
+	bool stdin_pending = false;
+
+	// Where the child's stdout and stderr go, if captured.
+	std::string output_file;
+
+	// Set once the exit was observed, or right away for results
+	// served from the cache, in which case there is no `proc`.
+	// Nodes of a batch have no `proc` until they are started,
+	// and never get one if they are skipped.
+	bool finished = false;
+	bool cached = false;
+	bool skipped = false;
+	int32_t exit_code = 0;
+
+	// Set if a thread of its own waits for the exit and records it,
+	// pollers then leave the entry alone.
+	bool has_waiter = false;
+
+	// Called with the mutex held, the first time the exit is observed,
+	// or when a batch node is skipped or fails to start.
+	std::function<void(proc_info & pi)> on_exit;
+
+	// Status reads may come from several connections at once;
+	// `process::poll` is not meant to be raced with itself.
+	std::mutex mutex;
+
+	// Set by `exec_registry::add`, which counts the entry until it finishes.
+	exec_registry * registry = nullptr;
+};
+
+// Keeps track of the executions started by the agent.
+//
+// Lookups are sharded by id, so status reads of different executions
+// don't contend. Entries are kept behind `shared_ptr`, a reader's entry
+// stays valid even if it is retired concurrently. Once a shard holds
+// more than its share of `max_live` entries, finished entries are
+// moved, in the order they finished, into a history file with one line
+// per entry; entries still running stay, without holding up the rest.
+// The output file of a retired entry is deleted.
+//
+// The history file is created in `history_dir`, but has no name, so
+// that agents sharing the directory don't see each other's. It's rotated
+// once it holds `max_history` entries, an in-memory index of record
+// offsets makes a lookup a single read.
+struct exec_registry
+{
+	explicit exec_registry(std::string history_dir, size_t max_live = 1024, size_t max_history = 64 * 1024);
+	exec_registry(exec_registry const &) = delete;
+	exec_registry & operator=(exec_registry const &) = delete;
+
+	size_t add(std::shared_ptr<proc_info> pi);
+	std::shared_ptr<proc_info> find(size_t id);
+
+	// Looks up a retired entry and returns its status record.
+	bool find_retired(size_t id, std::string & record);
+
+	// Counts the entries that are running and those that wait to be started.
+	// The counts are kept up to date as entries start and finish, reading
+	// them polls nothing; a process counts as running until its exit
+	// is observed.
+	void count_live(size_t & running, size_t & pending);
+
+private:
+	static constexpr size_t shard_count = 16;
+
+	struct shard
+	{
+		std::mutex mutex;
+		std::unordered_map<size_t, std::shared_ptr<proc_info>> live;
+
+		// Ids of the live entries that have finished, in that order.
+		std::deque<size_t> finished;
+
+		// Taken off `finished`, but in `live` until the history has them.
+		size_t retiring = 0;
+	};
+
+	struct history_file
+	{
+		file f;
+		uint64_t size = 0;
+
+		// The offset and length of the record of every id in the file.
+		std::unordered_map<size_t, std::pair<uint64_t, size_t>> index;
+	};
+
+	// Called by `finish_exec_locked`, with `pi.mutex` held.
+	void on_finished(proc_info const & pi);
+	void write_history(std::vector<std::shared_ptr<proc_info>> const & retired);
+
+	shard shards_[shard_count];
+	std::atomic<size_t> next_id_;
+	size_t max_live_per_shard_;
+
+	std::atomic<size_t> running_;
+	std::atomic<size_t> pending_;
+	friend void start_exec_locked(proc_info & pi, std::unique_ptr<process> proc);
+	friend void finish_exec_locked(proc_info & pi, int32_t exit_code);
+
+	std::mutex history_mutex_;
+	std::string history_dir_;
+	history_file history_;
+	history_file prev_history_;
+	size_t max_history_;
+};
+
+bool poll_exec(proc_info & pi);
+std::string format_exec_status(proc_info & pi);
+
+// For callers holding `pi.mutex`; doesn't poll the process.
+std::string format_exec_status_locked(proc_info const & pi);
+
+// Hands a batch node its started process, the caller holds `pi.mutex`.
+void start_exec_locked(proc_info & pi, std::unique_ptr<process> proc);
+
+// Records the exit and runs `on_exit`, the caller holds `pi.mutex`.
+void finish_exec_locked(proc_info & pi, int32_t exit_code);
+
+#endif // EXEC_REGISTRY_HPP
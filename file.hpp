@@ -4,6 +4,19 @@
 #include "stream.hpp"
 #include <string_view>
 #include <functional>
+#include <utility>
+
+struct socket_stream;
+
+// Changes whenever a file is written to or replaced, more reliably than
+// its size and `mtime`, which only has a resolution of a second.
+struct file_version
+{
+	uint64_t mtime_ns;
+	uint64_t ctime_ns;
+	uint64_t dev;
+	uint64_t ino;
+};
 
 struct file
 {
@@ -13,12 +26,32 @@ struct file
 	file & operator=(file && o);
 
 	void create(std::string_view name);
+
+	// Creates a file in `dir` that goes away once it's closed, or when
+	// the process dies; it can only be read through `read_at`.
+	void create_temporary(std::string_view dir);
 	void open_ro(std::string_view name);
 	void open_ro(std::string_view name, std::error_code & ec) noexcept;
 	void close();
 
 	uint64_t size();
 	uint64_t mtime();
+	file_version version();
+
+	// If the file has more than one name, identifies it among all files
+	// of the system, so that its hard links can be recognized.
+	bool link_id(std::pair<uint64_t, uint64_t> & id);
+
+	// Waits until the contents are on the disk.
+	void sync();
+
+	// Reads at `offset` without moving the position of the streams.
+	size_t read_at(uint64_t offset, char * buf, size_t len);
+
+	// Writes the next `len` bytes received on `sock` at the position,
+	// moving them within the kernel where it can, and `skip`s them
+	// in the socket's stream.
+	void splice_from(socket_stream & sock, uint64_t len);
 
 	istream & in_stream();
 	ostream & out_stream();
@@ -34,4 +67,27 @@ void enum_files(std::string_view top, std::function<void(std::string_view fname)
 
 void rmtree(std::string_view top, std::error_code & ec) noexcept;
 
+// Waits until the directory entries are on the disk.
+void sync_dir(std::string_view path);
+
+// Waits until everything written to the filesystem containing `path`
+// is on the disk, a single call instead of syncing every file.
+void sync_filesystem(std::string_view path);
+
+// Replaces `name` with a hard link to `target`.
+void link_file(std::string_view target, std::string_view name);
+
+// Replaces `dst` with a copy of `src` sharing its storage, if possible:
+// a reflink where the filesystem supports one, or a hard link if
+// `allow_hardlink`, otherwise a plain copy. A hard link is only safe
+// if neither file is ever written to in place.
+void clone_file(std::string_view src, std::string_view dst, bool allow_hardlink);
+
+// The working directory of the agent.
+std::string current_dir();
+
+// Creates the directory along with any missing parents.
+void makedirs(std::string_view path, std::error_code & ec) noexcept;
+void makedirs(std::string_view path);
+
 #endif // FILE_HPP
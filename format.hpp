@@ -4,8 +4,30 @@
 #include <string_view>
 #include <string>
 
-template <typename... P>
-std::string format(std::string_view fmt, P &&... p);
+// Replaces each `{}` in the format string with the next argument.
+// Arguments are strings or integers.
+//
+//     std::string url = format(FMT("exec/{}-{}"), uuid, id);
+//     format_to(out, FMT("{} {}\n"), name, value);
+//
+// The format string is a literal wrapped in FMT; it's parsed at compile
+// time, a mismatched number of arguments doesn't compile. The output is
+// sized up front and integers are written straight into it.
+#define FMT(s) ([] { \
+		struct format_literal \
+		{ \
+			static constexpr char const * str() { return s; } \
+			static constexpr size_t size() { return sizeof(s) - 1; } \
+		}; \
+		return format_literal(); \
+	}())
+
+template <typename Fmt, typename... P>
+std::string format(Fmt fmt, P const &... p);
+
+// Appends to `out` instead.
+template <typename Fmt, typename... P>
+void format_to(std::string & out, Fmt fmt, P const &... p);
 
 #include "format_impl.hpp"
 
@@ -1,46 +1,146 @@
 #include <type_traits>
-#include <memory>
+#include <string.h>
 
-inline void format_append(std::string & r, std::string_view fmt)
+namespace format_detail {
+
+constexpr size_t count_placeholders(char const * s, size_t len)
+{
+	size_t r = 0;
+	for (size_t i = 0; i + 1 < len; ++i)
+	{
+		if (s[i] == '{' && s[i + 1] == '}')
+		{
+			++r;
+			++i;
+		}
+	}
+	return r;
+}
+
+// Offsets of the placeholders, followed by the length of the string.
+template <size_t N>
+struct placeholders
+{
+	size_t pos[N + 1];
+};
+
+template <size_t N>
+constexpr placeholders<N> find_placeholders(char const * s, size_t len)
+{
+	placeholders<N> r = {};
+
+	size_t n = 0;
+	for (size_t i = 0; i + 1 < len && n != N; ++i)
+	{
+		if (s[i] == '{' && s[i + 1] == '}')
+			r.pos[n++] = i++;
+	}
+
+	r.pos[N] = len;
+	return r;
+}
+
+inline size_t arg_size(std::string_view v)
+{
+	return v.size();
+}
+
+inline void write_arg(char *& out, std::string_view v)
+{
+	memcpy(out, v.data(), v.size());
+	out += v.size();
+}
+
+template <typename Unsigned>
+size_t digit_count(Unsigned v)
 {
-	r.append(fmt);
+	size_t r = 1;
+	while (v >= 10)
+	{
+		v /= 10;
+		++r;
+	}
+	return r;
 }
 
-inline void format_append_one(std::string & r, std::string_view v)
+template <typename Integral>
+std::enable_if_t<std::is_integral<Integral>::value, std::make_unsigned_t<Integral>> magnitude(Integral v)
 {
-	r.append(v);
+	// Negating in the unsigned type is well-defined for the minimum value too.
+	std::make_unsigned_t<Integral> u = v;
+	return v < 0? 0 - u: u;
 }
 
 template <typename Integral>
-std::enable_if_t<std::is_integral<Integral>::value, void> format_append_one(std::string & r, Integral v)
+std::enable_if_t<std::is_integral<Integral>::value, size_t> arg_size(Integral v)
 {
-	r.append(std::to_string(v));
+	return (v < 0) + digit_count(magnitude(v));
 }
 
-template <typename P0, typename... P>
-void format_append(std::string & r, std::string_view fmt, P0 && p0, P &&... p)
+template <typename Integral>
+std::enable_if_t<std::is_integral<Integral>::value, void> write_arg(char *& out, Integral v)
 {
-	char const * first = fmt.begin();
-	char const * last = fmt.end();
+	if (v < 0)
+		*out++ = '-';
+
+	auto u = magnitude(v);
+	char * last = out + digit_count(u);
+	out = last;
 
-	for (char const * cur = first; cur != last; ++cur)
+	do
 	{
-		if (*cur == '{' && cur != last && cur[1] == '}')
-		{
-			r.append(first, cur);
-			format_append_one(r, std::forward<P0>(p0));
-			return format_append(r, std::string_view(cur + 2, last), std::forward<P>(p)...);
-		}
+		*--last = '0' + (char)(u % 10);
+		u /= 10;
 	}
+	while (u != 0);
+}
 
-	r.append(first, last);
+template <typename Fmt, typename... P>
+void format_to(std::string & r, P const &... p)
+{
+	constexpr size_t n = count_placeholders(Fmt::str(), Fmt::size());
+	static_assert(n == sizeof...(P), "the number of arguments doesn't match the format string");
+
+	static constexpr placeholders<n> ph = find_placeholders<n>(Fmt::str(), Fmt::size());
+
+	size_t sizes[] = { 0, arg_size(p)... };
+	size_t total = Fmt::size() - 2 * n;
+	for (size_t s : sizes)
+		total += s;
+
+	size_t start = r.size();
+	r.resize(start + total);
+	char * out = &r[start];
+
+	char const * fmt = Fmt::str();
+	size_t prev = 0;
+	size_t idx = 0;
+
+	auto literal = [&](size_t end) {
+		memcpy(out, fmt + prev, end - prev);
+		out += end - prev;
+		prev = end + 2;
+	};
+
+	int expand[] = { 0, (literal(ph.pos[idx++]), write_arg(out, p), 0)... };
+	(void)expand;
+	(void)literal;
+
+	memcpy(out, fmt + prev, Fmt::size() - prev);
 }
 
+}
 
-template <typename... P>
-std::string format(std::string_view fmt, P &&... p)
+template <typename Fmt, typename... P>
+std::string format(Fmt, P const &... p)
 {
 	std::string r;
-	format_append(r, fmt, std::forward<P>(p)...);
+	format_detail::format_to<Fmt>(r, p...);
 	return r;
 }
+
+template <typename Fmt, typename... P>
+void format_to(std::string & out, Fmt, P const &... p)
+{
+	format_detail::format_to<Fmt>(out, p...);
+}
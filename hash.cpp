@@ -0,0 +1,77 @@
+#include "hash.hpp"
+#include "file.hpp"
+#include <openssl/evp.h>
+#include <memory>
+#include <new>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+sha256::sha256()
+{
+	EVP_MD_CTX * ctx = EVP_MD_CTX_new();
+	if (!ctx)
+		throw std::bad_alloc();
+
+	EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+	ctx_ = ctx;
+}
+
+sha256::~sha256()
+{
+	EVP_MD_CTX_free(static_cast<EVP_MD_CTX *>(ctx_));
+}
+
+void sha256::update(char const * buf, size_t len)
+{
+	EVP_DigestUpdate(static_cast<EVP_MD_CTX *>(ctx_), buf, len);
+}
+
+void sha256::update(std::string_view s)
+{
+	this->update(s.data(), s.size());
+}
+
+void sha256::update(istream & in)
+{
+	// Off the stack, which is small in a handler.
+	size_t const buf_size = 64 * 1024;
+	std::unique_ptr<char[]> buf(new char[buf_size]);
+	for (;;)
+	{
+		size_t r = in.read(buf.get(), buf_size);
+		if (r == 0)
+			break;
+		this->update(buf.get(), r);
+	}
+}
+
+std::string sha256::hexdigest()
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int len;
+	EVP_DigestFinal_ex(static_cast<EVP_MD_CTX *>(ctx_), md, &len);
+
+	static char const digits[] = "0123456789abcdef";
+
+	std::string r;
+	r.reserve(len * 2);
+	for (unsigned int i = 0; i != len; ++i)
+	{
+		r.push_back(digits[md[i] >> 4]);
+		r.push_back(digits[md[i] & 0xf]);
+	}
+	return r;
+}
+
+std::string sha256_file(std::string_view path)
+{
+	file fin;
+	fin.open_ro(path);
+
+	sha256 h;
+	h.update(fin.in_stream());
+	return h.hexdigest();
+}
@@ -0,0 +1,28 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include "stream.hpp"
+#include <string>
+#include <string_view>
+
+struct sha256
+{
+	sha256();
+	~sha256();
+	sha256(sha256 const &) = delete;
+	sha256 & operator=(sha256 const &) = delete;
+
+	void update(char const * buf, size_t len);
+	void update(std::string_view s);
+	void update(istream & in);
+
+	// Returns the lowercase hex digest; the object can't be updated afterwards.
+	std::string hexdigest();
+
+private:
+	void * ctx_;
+};
+
+std::string sha256_file(std::string_view path);
+
+#endif // HASH_HPP
@@ -0,0 +1,53 @@
+#include "json_writer.hpp"
+
+void json_writer::write_string(std::string_view s)
+{
+	static char const hex[] = "0123456789abcdef";
+
+	out_.push_back('"');
+
+	// Runs of characters that need no escaping are appended at once.
+	size_t first = 0;
+	for (size_t i = 0; i != s.size(); ++i)
+	{
+		unsigned char ch = s[i];
+		if (ch >= 0x20 && ch != '"' && ch != '\\')
+			continue;
+
+		out_.append(s.data() + first, i - first);
+		first = i + 1;
+
+		switch (ch)
+		{
+		case '"':
+			out_.append("\\\"");
+			break;
+		case '\\':
+			out_.append("\\\\");
+			break;
+		case '\b':
+			out_.append("\\b");
+			break;
+		case '\f':
+			out_.append("\\f");
+			break;
+		case '\n':
+			out_.append("\\n");
+			break;
+		case '\r':
+			out_.append("\\r");
+			break;
+		case '\t':
+			out_.append("\\t");
+			break;
+		default:
+			{
+				char esc[] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xf] };
+				out_.append(esc, sizeof esc);
+			}
+		}
+	}
+
+	out_.append(s.data() + first, s.size() - first);
+	out_.push_back('"');
+}
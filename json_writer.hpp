@@ -0,0 +1,140 @@
+#ifndef JSON_WRITER_HPP
+#define JSON_WRITER_HPP
+
+#include "format.hpp"
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <stdint.h>
+
+// Appends JSON to a string as it's written, without building a document
+// first. Commas are tracked per nesting level in a bit mask, so nothing
+// is allocated beyond the output itself; nesting is limited to 64 levels.
+//
+//     json_writer w(out);
+//     w.begin_object();
+//     w.key("id").value(id);
+//     w.key("command").begin_array();
+//     for (auto && arg : cmd)
+//         w.value(arg);
+//     w.end_array();
+//     w.end_object();
+//
+// Keys are written in the order given; nlohmann::json sorts them,
+// callers that replace it should keep its order.
+struct json_writer
+{
+	explicit json_writer(std::string & out)
+		: out_(out), depth_(0), has_items_(0)
+	{
+	}
+
+	json_writer & begin_object()
+	{
+		this->open('{');
+		return *this;
+	}
+
+	json_writer & end_object()
+	{
+		this->close('}');
+		return *this;
+	}
+
+	json_writer & begin_array()
+	{
+		this->open('[');
+		return *this;
+	}
+
+	json_writer & end_array()
+	{
+		this->close(']');
+		return *this;
+	}
+
+	json_writer & key(std::string_view k)
+	{
+		this->separate();
+		this->write_string(k);
+		out_.push_back(':');
+
+		// The value that follows needs no comma.
+		has_items_ &= ~this->level_bit();
+		return *this;
+	}
+
+	json_writer & value(std::string_view v)
+	{
+		this->separate();
+		this->write_string(v);
+		return *this;
+	}
+
+	json_writer & value(char const * v)
+	{
+		return this->value(std::string_view(v));
+	}
+
+	json_writer & value(std::string const & v)
+	{
+		return this->value(std::string_view(v));
+	}
+
+	json_writer & value(bool v)
+	{
+		this->separate();
+		out_.append(v? "true": "false");
+		return *this;
+	}
+
+	template <typename Integral>
+	std::enable_if_t<std::is_integral<Integral>::value, json_writer &> value(Integral v)
+	{
+		this->separate();
+		format_to(out_, FMT("{}"), v);
+		return *this;
+	}
+
+	json_writer & null()
+	{
+		this->separate();
+		out_.append("null");
+		return *this;
+	}
+
+private:
+	std::string & out_;
+	size_t depth_;
+	uint64_t has_items_;
+
+	uint64_t level_bit() const
+	{
+		return (uint64_t)1 << (depth_ & 63);
+	}
+
+	void separate()
+	{
+		if (has_items_ & this->level_bit())
+			out_.push_back(',');
+		has_items_ |= this->level_bit();
+	}
+
+	void open(char ch)
+	{
+		this->separate();
+		out_.push_back(ch);
+		++depth_;
+		has_items_ &= ~this->level_bit();
+	}
+
+	void close(char ch)
+	{
+		--depth_;
+		out_.push_back(ch);
+	}
+
+	void write_string(std::string_view s);
+};
+
+#endif // JSON_WRITER_HPP
@@ -0,0 +1,692 @@
+#include "argparse.hpp"
+#include "file.hpp"
+#include "format.hpp"
+#include "tar.hpp"
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <json.hpp>
+using nlohmann::json;
+
+// Starts an agent on localhost against a scratch workspace and drives
+// a mix of requests at it over a number of keep-alive connections,
+// optionally over TLS with a freshly generated certificate.
+// Reports throughput and latency percentiles per route as JSON.
+
+namespace {
+
+enum route_t { route_tar_get, route_tar_post, route_files, route_exec, route_count };
+
+char const * const g_route_names[route_count] = { "tar_get", "tar_post", "files", "exec" };
+
+struct xorshift
+{
+	uint64_t state;
+
+	explicit xorshift(uint64_t seed)
+		: state(seed * 0x9e3779b97f4a7c15 + 1)
+	{
+	}
+
+	uint64_t next()
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+};
+
+[[noreturn]] void throw_errno()
+{
+	throw std::system_error(errno, std::system_category());
+}
+
+[[noreturn]] void throw_ssl(char const * what)
+{
+	char buf[256];
+	ERR_error_string_n(ERR_get_error(), buf, sizeof buf);
+	throw std::runtime_error(format(FMT("{}: {}"), what, (char const *)buf));
+}
+
+void generate_cert(std::string const & key_file, std::string const & cert_file)
+{
+	std::unique_ptr<EVP_PKEY_CTX, void (*)(EVP_PKEY_CTX *)> kctx(EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr), &EVP_PKEY_CTX_free);
+	EVP_PKEY * key_raw = nullptr;
+	if (!kctx || EVP_PKEY_keygen_init(kctx.get()) <= 0
+		|| EVP_PKEY_CTX_set_rsa_keygen_bits(kctx.get(), 2048) <= 0
+		|| EVP_PKEY_keygen(kctx.get(), &key_raw) <= 0)
+	{
+		throw_ssl("keygen");
+	}
+
+	std::unique_ptr<EVP_PKEY, void (*)(EVP_PKEY *)> key(key_raw, &EVP_PKEY_free);
+	std::unique_ptr<X509, void (*)(X509 *)> cert(X509_new(), &X509_free);
+	if (!cert)
+		throw std::bad_alloc();
+
+	X509_set_version(cert.get(), 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+	X509_gmtime_adj(X509_get_notBefore(cert.get()), 0);
+	X509_gmtime_adj(X509_get_notAfter(cert.get()), 24 * 60 * 60);
+	X509_set_pubkey(cert.get(), key.get());
+
+	X509_NAME * name = X509_get_subject_name(cert.get());
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char const *)"localhost", -1, -1, 0);
+	X509_set_issuer_name(cert.get(), name);
+
+	if (!X509_sign(cert.get(), key.get(), EVP_sha256()))
+		throw_ssl("sign");
+
+	std::unique_ptr<BIO, int (*)(BIO *)> kb(BIO_new_file(key_file.c_str(), "w"), &BIO_free);
+	if (!kb || !PEM_write_bio_PrivateKey(kb.get(), key.get(), nullptr, nullptr, 0, nullptr, nullptr))
+		throw_ssl("write key");
+
+	std::unique_ptr<BIO, int (*)(BIO *)> cb(BIO_new_file(cert_file.c_str(), "w"), &BIO_free);
+	if (!cb || !PEM_write_bio_X509(cb.get(), cert.get()))
+		throw_ssl("write cert");
+}
+
+struct string_ostream final
+	: ostream
+{
+	std::string data;
+
+	size_t write(char const * buf, size_t len) override
+	{
+		data.append(buf, len);
+		return len;
+	}
+};
+
+struct string_istream final
+	: istream
+{
+	explicit string_istream(std::string_view data)
+		: data_(data)
+	{
+	}
+
+	size_t read(char * buf, size_t len) override
+	{
+		len = std::min(len, data_.size());
+		memcpy(buf, data_.data(), len);
+		data_ = data_.substr(len);
+		return len;
+	}
+
+private:
+	std::string_view data_;
+};
+
+struct http_response
+{
+	int status = 0;
+	std::string location;
+	std::string body;
+};
+
+// A keep-alive HTTP/1.1 connection, reconnects when the server closes it.
+struct client
+{
+	client(int port, SSL_CTX * ssl_ctx)
+		: port_(port), ssl_ctx_(ssl_ctx), fd_(-1), ssl_(nullptr), rpos_(0)
+	{
+	}
+
+	~client()
+	{
+		this->disconnect();
+	}
+
+	http_response request(std::string_view method, std::string_view path, std::string_view content_type, std::string_view body)
+	{
+		if (fd_ < 0)
+			this->connect();
+
+		std::string req = format(FMT("{} {} HTTP/1.1\r\nhost: localhost\r\ncontent-length: {}\r\n"), method, path, body.size());
+		if (!content_type.empty())
+			format_to(req, FMT("content-type: {}\r\n"), content_type);
+		req.append("\r\n");
+		req.append(body);
+		this->write_all(req);
+
+		http_response r;
+		std::string line = this->read_line();
+		if (line.size() < 12 || line.compare(0, 5, "HTTP/") != 0)
+			throw std::runtime_error("invalid status line");
+		r.status = std::stoi(line.substr(9, 3));
+
+		bool chunked = false;
+		bool close = false;
+		long long content_length = -1;
+		for (;;)
+		{
+			line = this->read_line();
+			if (line.empty())
+				break;
+
+			size_t sep = line.find(':');
+			if (sep == std::string::npos)
+				continue;
+
+			std::string name = line.substr(0, sep);
+			std::transform(name.begin(), name.end(), name.begin(), [](char ch) { return (char)tolower(ch); });
+			std::string value = line.substr(line.find_first_not_of(' ', sep + 1));
+
+			if (name == "content-length")
+				content_length = std::stoll(value);
+			else if (name == "transfer-encoding" && value == "chunked")
+				chunked = true;
+			else if (name == "connection" && value == "close")
+				close = true;
+			else if (name == "location")
+				r.location = value;
+		}
+
+		if (chunked)
+		{
+			for (;;)
+			{
+				size_t len = std::stoul(this->read_line(), nullptr, 16);
+				if (len == 0)
+				{
+					while (!this->read_line().empty())
+					{
+					}
+					break;
+				}
+
+				this->read_body(r.body, len);
+				this->read_line();
+			}
+		}
+		else if (content_length >= 0)
+		{
+			this->read_body(r.body, (size_t)content_length);
+		}
+		else if (method != "HEAD" && r.status != 204 && r.status != 304)
+		{
+			this->read_body(r.body, SIZE_MAX);
+			close = true;
+		}
+
+		if (close)
+			this->disconnect();
+		return r;
+	}
+
+	void disconnect()
+	{
+		if (ssl_)
+		{
+			SSL_free(ssl_);
+			ssl_ = nullptr;
+		}
+
+		if (fd_ >= 0)
+		{
+			::close(fd_);
+			fd_ = -1;
+		}
+
+		rbuf_.clear();
+		rpos_ = 0;
+	}
+
+	void connect()
+	{
+		fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd_ < 0)
+			throw_errno();
+
+		sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port_);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (::connect(fd_, (sockaddr *)&addr, sizeof addr) == -1)
+		{
+			int err = errno;
+			this->disconnect();
+			throw std::system_error(err, std::system_category());
+		}
+
+		int one = 1;
+		setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+		if (ssl_ctx_)
+		{
+			ssl_ = SSL_new(ssl_ctx_);
+			if (!ssl_)
+				throw std::bad_alloc();
+
+			SSL_set_fd(ssl_, fd_);
+			if (SSL_connect(ssl_) != 1)
+			{
+				this->disconnect();
+				throw_ssl("connect");
+			}
+		}
+	}
+
+private:
+	int port_;
+	SSL_CTX * ssl_ctx_;
+	int fd_;
+	SSL * ssl_;
+
+	std::string rbuf_;
+	size_t rpos_;
+
+	void write_all(std::string_view data)
+	{
+		while (!data.empty())
+		{
+			ssize_t r = ssl_
+				? SSL_write(ssl_, data.data(), (int)data.size())
+				: send(fd_, data.data(), data.size(), MSG_NOSIGNAL);
+			if (r <= 0)
+				throw std::runtime_error("write failed");
+			data = data.substr(r);
+		}
+	}
+
+	bool fill()
+	{
+		if (rpos_ == rbuf_.size())
+		{
+			rbuf_.clear();
+			rpos_ = 0;
+		}
+
+		char buf[64 * 1024];
+		ssize_t r = ssl_
+			? SSL_read(ssl_, buf, sizeof buf)
+			: recv(fd_, buf, sizeof buf, 0);
+		if (r < 0)
+			throw std::runtime_error("read failed");
+
+		rbuf_.append(buf, r);
+		return r != 0;
+	}
+
+	std::string read_line()
+	{
+		for (;;)
+		{
+			size_t eol = rbuf_.find("\r\n", rpos_);
+			if (eol != std::string::npos)
+			{
+				std::string r = rbuf_.substr(rpos_, eol - rpos_);
+				rpos_ = eol + 2;
+				return r;
+			}
+
+			if (!this->fill())
+				throw std::runtime_error("unexpected end of response");
+		}
+	}
+
+	void read_body(std::string & body, size_t len)
+	{
+		while (len != 0)
+		{
+			if (rpos_ == rbuf_.size() && !this->fill())
+			{
+				if (len == SIZE_MAX)
+					return;
+				throw std::runtime_error("unexpected end of response");
+			}
+
+			size_t chunk = std::min(len, rbuf_.size() - rpos_);
+			body.append(rbuf_, rpos_, chunk);
+			rpos_ += chunk;
+			if (len != SIZE_MAX)
+				len -= chunk;
+		}
+	}
+};
+
+struct route_stats
+{
+	// Of the successful requests only, failures usually return early.
+	std::vector<double> latencies_ms;
+	uint64_t errors = 0;
+	uint64_t bytes = 0;
+
+	// Of the last failed request, 0 if it threw.
+	int last_error_status = 0;
+};
+
+struct worker_stats
+{
+	route_stats routes[route_count];
+};
+
+struct worker_params
+{
+	int port;
+	SSL_CTX * ssl_ctx;
+	std::string workspace;
+	size_t file_count;
+	int weights[route_count];
+	std::chrono::steady_clock::time_point deadline;
+};
+
+void run_worker(size_t idx, worker_params const & p, worker_stats & stats)
+{
+	client c(p.port, p.ssl_ctx);
+	xorshift rng(idx + 1);
+
+	int total_weight = 0;
+	for (int w : p.weights)
+		total_weight += w;
+
+	// Every connection uploads the same small archive under its own names.
+	string_ostream upload;
+	{
+		std::string content(4096, 'x');
+		tarfile_writer tw(upload);
+		for (size_t i = 0; i != 8; ++i)
+		{
+			string_istream in(content);
+			tw.add(format(FMT("up_{}_{}"), idx, i), content.size(), 0, in);
+		}
+		tw.close();
+	}
+
+	while (std::chrono::steady_clock::now() < p.deadline)
+	{
+		int pick = (int)(rng.next() % total_weight);
+		size_t route = 0;
+		while (pick >= p.weights[route])
+			pick -= p.weights[route++];
+
+		route_stats & st = stats.routes[route];
+		auto start = std::chrono::steady_clock::now();
+		bool ok = false;
+
+		try
+		{
+			http_response r;
+			switch (route)
+			{
+			case route_tar_get:
+				r = c.request("GET", "/tar", "", "");
+				break;
+			case route_tar_post:
+				r = c.request("POST", "/tar", "application/x-tar", upload.data);
+				break;
+			case route_files:
+				r = c.request("GET", format(FMT("/files/{}/f{}"), p.workspace, rng.next() % p.file_count), "", "");
+				break;
+			case route_exec:
+				// Timed until the process is seen to have exited.
+				r = c.request("POST", "/exec/", "application/json", "{\"cmd\":[\"true\"],\"pure\":true}");
+				if (r.status == 201)
+				{
+					std::string loc = r.location;
+					if (loc.empty() || loc[0] != '/')
+						loc.insert(0, "/");
+
+					while (r.status / 100 == 2 && r.body.find("\"exited\"") == std::string::npos)
+						r = c.request("GET", loc, "", "");
+				}
+				break;
+			}
+
+			ok = r.status >= 200 && r.status < 300;
+			if (!ok)
+			{
+				++st.errors;
+				st.last_error_status = r.status;
+			}
+			st.bytes += r.body.size();
+		}
+		catch (...)
+		{
+			++st.errors;
+			st.last_error_status = 0;
+			c.disconnect();
+		}
+
+		std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+		if (ok)
+			st.latencies_ms.push_back(d.count());
+	}
+}
+
+double percentile(std::vector<double> const & sorted, double q)
+{
+	if (sorted.empty())
+		return 0;
+
+	size_t idx = (size_t)(q * sorted.size());
+	return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+pid_t start_agent(std::vector<std::string> const & args)
+{
+	std::vector<char *> argv;
+	for (auto && a : args)
+		argv.push_back(const_cast<char *>(a.c_str()));
+	argv.push_back(nullptr);
+
+	pid_t pid = fork();
+	if (pid == -1)
+		throw_errno();
+
+	if (pid == 0)
+	{
+		execv(argv[0], argv.data());
+		_exit(127);
+	}
+
+	return pid;
+}
+
+}
+
+int main(int argc, char * argv[])
+{
+	std::string agent = "./agent_maybe";
+	std::string scratch;
+	int port = 18080;
+	int connections = 8;
+	int duration = 10;
+	int files = 200;
+	int reactors = 0;
+	bool tls = false;
+	int tar_get = 1, tar_post = 1, files_get = 6, exec = 2;
+
+	parse_argv(argc, argv, {
+		{ agent, "--agent" },
+		{ scratch, "--scratch" },
+		{ port, "--port", 'p' },
+		{ connections, "--connections", 'c' },
+		{ duration, "--duration", 'd' },
+		{ files, "--files" },
+		{ reactors, "--reactors" },
+		{ tls, "--tls" },
+		{ tar_get, "--tar-get-weight" },
+		{ tar_post, "--tar-post-weight" },
+		{ files_get, "--files-weight" },
+		{ exec, "--exec-weight" },
+	});
+
+	// Only a directory of our own is removed at the end.
+	bool own_scratch = scratch.empty();
+	if (own_scratch)
+	{
+		char tmpl[] = "/tmp/agent_maybe_load.XXXXXX";
+		if (!mkdtemp(tmpl))
+			throw_errno();
+		scratch = tmpl;
+	}
+
+	std::string workspace = join_paths(scratch, "workspace");
+	makedirs(workspace);
+
+	{
+		xorshift rng(0);
+		std::string content;
+		for (int i = 0; i < files; ++i)
+		{
+			content.assign(rng.next() % (64 * 1024), 'a' + i % 26);
+
+			file fout;
+			fout.create(join_paths(workspace, format(FMT("f{}"), i)));
+			fout.out_stream().write_all(content);
+		}
+	}
+
+	std::vector<std::string> args = { agent, "--port", std::to_string(port) };
+	if (reactors > 0)
+	{
+		args.push_back("--reactors");
+		args.push_back(std::to_string(reactors));
+	}
+
+	std::unique_ptr<SSL_CTX, void (*)(SSL_CTX *)> ssl_ctx(nullptr, &SSL_CTX_free);
+	if (tls)
+	{
+		std::string key_file = join_paths(scratch, "key.pem");
+		std::string cert_file = join_paths(scratch, "cert.pem");
+		generate_cert(key_file, cert_file);
+
+		args.insert(args.end(), { "--tls-key", key_file, "--tls-cert", cert_file });
+
+		// No ALPN, the agent speaks HTTP/1.1 to us.
+		ssl_ctx.reset(SSL_CTX_new(TLS_client_method()));
+		if (!ssl_ctx)
+			throw std::bad_alloc();
+		SSL_CTX_set_verify(ssl_ctx.get(), SSL_VERIFY_NONE, nullptr);
+	}
+
+	args.push_back("load-test");
+	args.push_back(workspace);
+
+	pid_t agent_pid = start_agent(args);
+
+	// Wait for the agent to start listening.
+	{
+		client probe(port, ssl_ctx.get());
+		for (int attempt = 0;; ++attempt)
+		{
+			try
+			{
+				probe.connect();
+				break;
+			}
+			catch (...)
+			{
+				if (attempt == 100)
+				{
+					kill(agent_pid, SIGKILL);
+					throw;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+		}
+	}
+
+	worker_params params;
+	params.port = port;
+	params.ssl_ctx = ssl_ctx.get();
+	params.workspace = workspace;
+	params.file_count = std::max(files, 1);
+	params.weights[route_tar_get] = tar_get;
+	params.weights[route_tar_post] = tar_post;
+	params.weights[route_files] = files > 0? files_get: 0;
+	params.weights[route_exec] = exec;
+
+	auto start = std::chrono::steady_clock::now();
+	params.deadline = start + std::chrono::seconds(duration);
+
+	std::vector<worker_stats> stats(connections);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < connections; ++i)
+		threads.emplace_back([i, &params, &stats] { run_worker(i, params, stats[i]); });
+	for (auto && t : threads)
+		t.join();
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	kill(agent_pid, SIGTERM);
+	waitpid(agent_pid, nullptr, 0);
+
+	json routes = json::object();
+	for (size_t r = 0; r != route_count; ++r)
+	{
+		route_stats total;
+		for (auto && s : stats)
+		{
+			route_stats const & rs = s.routes[r];
+			total.latencies_ms.insert(total.latencies_ms.end(), rs.latencies_ms.begin(), rs.latencies_ms.end());
+			total.errors += rs.errors;
+			total.bytes += rs.bytes;
+			if (rs.errors != 0)
+				total.last_error_status = rs.last_error_status;
+		}
+
+		std::sort(total.latencies_ms.begin(), total.latencies_ms.end());
+
+		// A route that fails quickly would otherwise look fast.
+		if (total.errors != 0)
+		{
+			std::string last = total.last_error_status != 0? format(FMT("status {}"), total.last_error_status): "an exception";
+			std::cerr << format(FMT("warning: {}: {} of {} requests failed, the last one with {}\n"),
+				g_route_names[r], total.errors, total.latencies_ms.size() + total.errors, last);
+		}
+
+		// The rate and the percentiles are of the successful requests.
+		routes[g_route_names[r]] = {
+			{ "requests", total.latencies_ms.size() + total.errors },
+			{ "errors", total.errors },
+			{ "requests_per_s", total.latencies_ms.size() / elapsed.count() },
+			{ "mb_per_s", total.bytes / elapsed.count() / 1e6 },
+			{ "p50_ms", percentile(total.latencies_ms, 0.5) },
+			{ "p99_ms", percentile(total.latencies_ms, 0.99) },
+			{ "p999_ms", percentile(total.latencies_ms, 0.999) },
+		};
+	}
+
+	json r = {
+		{ "tls", tls },
+		{ "connections", connections },
+		{ "reactors", reactors },
+		{ "seconds", elapsed.count() },
+		{ "routes", std::move(routes) },
+	};
+	std::cout << r.dump(2) << "\n";
+
+	if (own_scratch)
+	{
+		std::error_code ec;
+		rmtree(scratch, ec);
+	}
+}
@@ -4,13 +4,31 @@
 #include "chan.hpp"
 #include "tar.hpp"
 #include "argparse.hpp"
+#include "blob_store.hpp"
+#include "blocking.hpp"
 #include "process.hpp"
 #include "format.hpp"
+#include "json_writer.hpp"
 #include "guid.hpp"
+#include "hash.hpp"
 #include "known_paths.hpp"
 #include "tls.hpp"
+#include "server.hpp"
+#include "exec_registry.hpp"
+#include "exec_cache.hpp"
+#include "exec_batch.hpp"
+#include "events.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <set>
 #include <mutex>
+#include <thread>
 
 #include <string_utils.hpp>
 
@@ -24,12 +42,42 @@ using std::string_view;
 
 struct app
 {
-	explicit app(std::string workspace, std::string image_name, std::string stop_cmd)
-		: status_(status_t::clean), workspace_(move(workspace)), image_name_(move(image_name)),
-		stop_cmd_(move(stop_cmd)), error_(0), stopping_(false)
+	struct workspace;
+
+	// Besides the default workspace, which is served at the root, named
+	// workspaces are served under `/ws/<name>/`, each with its own status,
+	// executions and events. Executions of a named workspace start
+	// in its directory.
+	explicit app(std::string default_dir, std::vector<std::pair<std::string, std::string>> const & named,
+		std::string image_name, std::string stop_cmd, uint64_t cache_size)
+		: image_name_(move(image_name)), stop_cmd_(move(stop_cmd)), error_(0), stopping_(false),
+		cache_(get_appdata_dir() + "/remote_test_agent.cache", cache_size),
+		blobs_(get_appdata_dir() + "/remote_test_agent.blobs")
 	{
 		auto appdata = get_appdata_dir();
 		state_file_ = appdata + "/remote_test_agent.json";
+		cwd_ = current_dir();
+
+		auto ws = std::make_unique<workspace>("default", "", move(default_dir), "", appdata);
+		default_ = ws.get();
+		workspaces_.emplace(default_->name, std::move(ws));
+
+		for (auto && nw : named)
+		{
+			makedirs(nw.second);
+
+			auto ws = std::make_unique<workspace>(nw.first, format(FMT("ws/{}/"), nw.first), nw.second, nw.second, appdata);
+			if (!workspaces_.emplace(nw.first, std::move(ws)).second)
+				throw std::runtime_error(format(FMT("duplicate workspace: {}"), nw.first));
+		}
+
+		// Captured outputs only live for the session.
+		output_dir_ = appdata + "/remote_test_agent.output";
+		{
+			std::error_code ec;
+			rmtree(output_dir_, ec);
+			makedirs(output_dir_);
+		}
 
 		{
 			file fin;
@@ -55,6 +103,8 @@ struct app
 
 		session_count_ += 1;
 		this->save_state_file();
+
+		std::thread([this] { this->watch_exits(); }).detach();
 	}
 
 	bool parse_state_file(istream & in)
@@ -89,7 +139,7 @@ struct app
 		fout.out_stream().write_all(j.dump());
 	}
 
-	response get_image(request const & req)
+	std::string format_image_status(workspace & ws)
 	{
 		string_view status;
 		if (stopping_)
@@ -98,7 +148,7 @@ struct app
 		}
 		else
 		{
-			switch (status_)
+			switch (ws.status)
 			{
 			case status_t::clean:
 				status = "clean";
@@ -112,15 +162,102 @@ struct app
 			}
 		}
 
-		json r = {
-			{ "status", std::string(status) },
-			{ "name", image_name_ },
+		std::string r;
+		json_writer w(r);
+		w.begin_object();
+		w.key("name").value(image_name_);
+		w.key("status").value(status);
+		w.end_object();
+		return r;
+	}
+
+	response get_image(workspace & ws, request const & req)
+	{
+		return{ this->format_image_status(ws), { { "content-type", "application/json" } } };
+	}
+
+	void set_unpure(workspace & ws)
+	{
+		{
+			std::lock_guard<std::mutex> l(ws.mutex);
+			if (ws.status == status_t::unpure)
+				return;
+			ws.status = status_t::unpure;
+		}
+
+		ws.events.publish("image", this->format_image_status(ws));
+	}
+
+	// Exits are published as they are observed. Nodes of a batch are
+	// observed by the batch, other executions by `watch_exits`.
+	void publish_exits(workspace & ws, proc_info & pi)
+	{
+		auto prev = std::move(pi.on_exit);
+		pi.on_exit = [&ws, prev](proc_info & pi) {
+			if (prev)
+				prev(pi);
+			ws.events.publish("exec", format_exec_status_locked(pi));
 		};
+	}
+
+	void watch_exits()
+	{
+		for (;;)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
-		return{ r.dump(), { { "content-type", "application/json" } } };
+			for (auto && kv : workspaces_)
+				this->poll_watched(*kv.second);
+		}
 	}
 
-	response stop_image(request const & req)
+	// Runs whether or not anyone is subscribed: an exit observed here
+	// is published and lets the registry retire the entry, and a watched
+	// entry is dropped as soon as it's finished or gone.
+	void poll_watched(workspace & ws)
+	{
+		std::vector<std::shared_ptr<proc_info>> watched;
+		{
+			std::lock_guard<std::mutex> l(ws.mutex);
+			for (auto && w : ws.watched)
+			{
+				if (auto pi = w.lock())
+					watched.push_back(std::move(pi));
+			}
+		}
+
+		std::vector<proc_info const *> finished;
+		for (auto && pi : watched)
+		{
+			if (poll_exec(*pi))
+				finished.push_back(pi.get());
+		}
+
+		std::sort(finished.begin(), finished.end());
+
+		std::lock_guard<std::mutex> l(ws.mutex);
+		ws.watched.erase(std::remove_if(ws.watched.begin(), ws.watched.end(), [&finished](std::weak_ptr<proc_info> const & w) {
+			auto pi = w.lock();
+			return !pi || std::binary_search(finished.begin(), finished.end(), pi.get());
+		}), ws.watched.end());
+	}
+
+	// A stream of server-sent events, see `event_bus`, starting with
+	// the image status. The stream is read by the handler of
+	// the connection, clients should give it a connection of its own.
+	//
+	// Of the image statuses, only `unpure` and `stopping` are ever
+	// entered, `clean` is the initial one and nothing makes an image
+	// `dirty`; the snapshot at the start covers them.
+	response get_events(workspace & ws, request const & req, socket_stream * sock)
+	{
+		return{ ws.events.subscribe("image", this->format_image_status(ws), sock), {
+			{ "content-type", "text/event-stream" },
+			{ "cache-control", "no-cache" },
+		} };
+	}
+
+	response stop_image(workspace & ws, request const & req)
 	{
 		if (stop_cmd_.empty())
 			return 404;
@@ -128,67 +265,413 @@ struct app
 		if (!stopping_)
 		{
 			stopping_ = true;
+			for (auto && kv : workspaces_)
+				kv.second->events.publish("image", this->format_image_status(*kv.second));
+
 			try
 			{
-				error_ = run_process(stop_cmd_);
+				run_blocking([this] { error_ = run_process(stop_cmd_); });
 			}
 			catch (...)
 			{
 				error_ = -1;
 			}
 		}
-		return{ 303, { { "location", "/image" } } };
+		return{ 303, { { "location", format(FMT("/{}image"), ws.prefix) } } };
 	}
 
-	response get_tar(request const & req)
+	// The ETag is a hash of the workspace manifest, the paths, sizes
+	// and mtimes of the files and which of them are hard links to
+	// the same file, which is all the archive is made of.
+	// Computing it stats the files, but doesn't read them; neither
+	// does HEAD nor a GET answered with 304.
+	//
+	// The second and further names of a file go out as hard link
+	// entries, without the contents.
+	response get_tar(workspace & ws, request const & req, bool head)
 	{
-		auto body = make_istream([this](ostream & out) {
-			//filter_writer<gzip_filter> gz(out, /*compress=*/true);
-			tarfile_writer tf(out);
-			enum_files(this->workspace_, [this, &tf](std::string_view fname) {
+		static size_t const no_link = ~(size_t)0;
+
+		struct entry
+		{
+			std::string name;
+			uint64_t size;
+			uint64_t mtime;
+
+			// The index of the entry this one is a hard link to.
+			size_t link_to;
+			bool written;
+		};
+
+		auto entries = std::make_shared<std::vector<entry>>();
+		std::map<std::pair<uint64_t, uint64_t>, size_t> first_names;
+
+		// Every item is NUL-terminated, so that adjacent items can't run together.
+		sha256 h;
+		auto add = [&h](std::string_view item) {
+			h.update(item);
+			h.update(std::string_view("", 1));
+		};
+
+		// Bump when the archive layout changes.
+		add("tar3");
+
+		// Stats every file, off the worker.
+		run_blocking([&] {
+			enum_files(ws.root, [&](std::string_view fname) {
 				file fin;
-				fin.open_ro(join_paths(this->workspace_, fname));
-				tf.add(fname, fin.size(), fin.mtime(), fin.in_stream());
+				fin.open_ro(join_paths(ws.root, fname));
+
+				entry e = { std::string(fname), fin.size(), fin.mtime(), no_link, false };
+
+				std::pair<uint64_t, uint64_t> id;
+				if (fin.link_id(id))
+				{
+					auto it = first_names.emplace(id, entries->size()).first;
+					if (it->second != entries->size())
+						e.link_to = it->second;
+				}
+
+				// The identity catches a file replaced by one of the same size
+				// and times, the ctime one whose mtime was set back.
+				file_version v = fin.version();
+				add(e.name);
+				add(format(FMT("{}"), e.size));
+				add(format(FMT("{} {} {} {}"), v.mtime_ns, v.ctime_ns, v.dev, v.ino));
+				add(e.link_to == no_link? "": (*entries)[e.link_to].name);
+				entries->push_back(std::move(e));
 			});
+		});
+
+		std::string etag = format(FMT("\"{}\""), std::string_view(h.hexdigest()).substr(0, 32));
+
+		auto * inm = get_single(req.headers, "if-none-match");
+		if (inm && if_none_match(*inm, etag))
+			return{ 304, { { "etag", etag } } };
+
+		if (head)
+			return{ 200, { { "content-type", "application/x-tar" }, { "etag", etag } } };
+
+		// The files are read off the worker, which only passes the archive on.
+		auto body = make_blocking_istream([&ws, entries](ostream & out) {
+			//filter_writer<deflate_filter> gz(out, /*compress=*/true);
+			tarfile_writer tf(out);
+			for (entry & e : *entries)
+			{
+				// If the first name was deleted meanwhile, this one gets the contents.
+				if (e.link_to != no_link && (*entries)[e.link_to].written)
+				{
+					entry const & target = (*entries)[e.link_to];
+					if (tf.add_link(e.name, target.name, target.mtime))
+					{
+						e.written = true;
+						continue;
+					}
+				}
+
+				file fin;
+				std::error_code ec;
+				fin.open_ro(join_paths(ws.root, e.name), ec);
+
+				// Files deleted since the manifest was taken are left out.
+				if (ec == std::errc::no_such_file_or_directory)
+					continue;
+				if (ec)
+					throw std::system_error(ec);
+
+				tf.add(e.name, fin.size(), fin.mtime(), fin.in_stream());
+				e.written = true;
+			}
 			tf.close();
 		});
 
-		return{ body, { { "content-type", "application/x-tar" } } };
+		return{ body, { { "content-type", "application/x-tar" }, { "etag", etag } } };
+	}
+
+	// The `x-durability` header of POST /tar says what must be on the disk
+	// before the response is sent:
+	//
+	//  * `none`, the default, syncs nothing and leaves the writeback
+	//    to the kernel; enough for throwaway workspaces,
+	//  * `batch` syncs the filesystem once, at the end,
+	//  * `full` syncs every file as it's written and then the directories.
+	enum class durability_t { none, batch, full };
+
+	static bool parse_durability(request const & req, durability_t & r)
+	{
+		auto * d = get_single(req.headers, "x-durability");
+		if (!d || *d == "none")
+			r = durability_t::none;
+		else if (*d == "batch")
+			r = durability_t::batch;
+		else if (*d == "full")
+			r = durability_t::full;
+		else
+			return false;
+		return true;
+	}
+
+	// Accepts only decimal digits, unlike `std::stoull`, which skips
+	// whitespace, takes a sign and throws.
+	static bool parse_length(std::string_view s, uint64_t & r)
+	{
+		if (s.empty() || s.size() > 19)
+			return false;
+
+		r = 0;
+		for (char ch : s)
+		{
+			if (ch < '0' || ch > '9')
+				return false;
+			r = r * 10 + (ch - '0');
+		}
+
+		return true;
+	}
+
+	// Whether an If-None-Match header value matches `etag`, a strong
+	// entity tag: either `*`, or a comma-separated list of entity tags,
+	// compared weakly, so that `W/` prefixes are ignored (RFC 9110, 13.1.2).
+	// A malformed list matches nothing.
+	static bool if_none_match(std::string_view value, std::string_view etag)
+	{
+		auto skip_ows = [&value] {
+			while (!value.empty() && (value[0] == ' ' || value[0] == '\t'))
+				value.remove_prefix(1);
+		};
+
+		skip_ows();
+		while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+			value.remove_suffix(1);
+
+		if (value == "*")
+			return true;
+
+		while (!value.empty())
+		{
+			// Empty list elements are allowed.
+			if (value[0] != ',')
+			{
+				if (value.substr(0, 2) == "W/")
+					value.remove_prefix(2);
+
+				size_t end = !value.empty() && value[0] == '"'? value.find('"', 1): std::string_view::npos;
+				if (end == std::string_view::npos)
+					return false;
+
+				if (value.substr(0, end + 1) == etag)
+					return true;
+
+				value.remove_prefix(end + 1);
+				skip_ows();
+				if (!value.empty() && value[0] != ',')
+					return false;
+			}
+
+			if (!value.empty())
+				value.remove_prefix(1);
+			skip_ows();
+		}
+
+		return false;
+	}
+
+	// Whether `path` stays within the directory it's relative to:
+	// not absolute and without `..` components.
+	static bool is_contained_path(std::string_view path)
+	{
+		if (path.empty() || path[0] == '/' || path[0] == '\\' || path.find(':') != std::string_view::npos)
+			return false;
+
+		while (!path.empty())
+		{
+			size_t sep = path.find_first_of("/\\");
+			if (path.substr(0, sep) == "..")
+				return false;
+			if (sep == std::string_view::npos)
+				break;
+			path = path.substr(sep + 1);
+		}
+
+		return true;
+	}
+
+	// The parser recurses for every array and object, on the handler's
+	// coroutine stack; bodies nested deeper than any request needs are
+	// refused before it sees them.
+	static bool parse_body(request const & req, json & j)
+	{
+		std::string body = req.body->read_all();
+
+		size_t depth = 0;
+		bool in_string = false;
+		for (size_t i = 0; i < body.size(); ++i)
+		{
+			char ch = body[i];
+			if (in_string)
+			{
+				if (ch == '\\')
+					++i;
+				else if (ch == '"')
+					in_string = false;
+			}
+			else if (ch == '"')
+			{
+				in_string = true;
+			}
+			else if (ch == '[' || ch == '{')
+			{
+				if (++depth > max_json_depth)
+					return false;
+			}
+			else if ((ch == ']' || ch == '}') && depth != 0)
+			{
+				--depth;
+			}
+		}
+
+		j = json::parse(body);
+		return true;
 	}
 
-	response post_tar(request const & req)
+	// `sock` is the connection's socket if the request came over plain
+	// HTTP/1.1, large entries of an uncompressed archive are then spliced
+	// from it into their files.
+	response post_tar(workspace & ws, request const & req, socket_stream * sock)
 	{
-		auto go = [this](tarfile_reader & tr) {
+		durability_t durability;
+		if (!parse_durability(req, durability))
+			return{ "x-durability must be none, batch or full", { { "content-type", "text/plain" } }, 400 };
+
+		std::set<std::string> dirs;
+
+		// Returns false if the archive names or links a path outside
+		// the workspace; entries before that one are extracted.
+		auto go = [&ws, durability, &dirs](tarfile_reader & tr) {
 			std::string name;
 			uint64_t size;
 			std::shared_ptr<istream> content;
 
 			while (tr.next(name, size, content))
 			{
-				file fout;
-				fout.create(join_paths(workspace_, name));
-				copy(fout.out_stream(), *content);
+				if (!is_contained_path(name))
+					return false;
+
+				std::string path = join_paths(ws.root, name);
+
+				if (tr.is_link())
+				{
+					// Would otherwise expose any file the agent can read.
+					if (!is_contained_path(tr.link_target()))
+						return false;
+
+					link_file(join_paths(ws.root, tr.link_target()), path);
+				}
+				else
+				{
+					// Like tar, replaces rather than truncates, `path` may be
+					// a hard link whose other names must keep their contents.
+					std::remove(path.c_str());
+
+					file fout;
+					fout.create(path);
+
+					trace_span span("copy");
+					tr.copy_content(fout);
+
+					if (durability == durability_t::full)
+						fout.sync();
+				}
+
+				if (durability == durability_t::full)
+				{
+					size_t sep = path.find_last_of("/\\");
+					dirs.insert(sep == std::string::npos? ws.root: path.substr(0, sep));
+				}
 			}
+
+			return true;
+		};
+
+		auto inflate = [&go](istream & body) {
+			counting_istream gz_in(body, g_metrics.gzip_compressed_bytes);
+			filter_reader<deflate_filter> gz(gz_in, /*compress=*/false);
+			counting_istream gz_out(gz, g_metrics.gzip_uncompressed_bytes);
+			tarfile_reader tr(gz_out);
+			return go(tr);
 		};
 
+		uint64_t length = 0;
+		auto * cl = get_single(req.headers, "content-length");
+		if (cl && !parse_length(*cl, length))
+			return{ "invalid content-length", { { "content-type", "text/plain" } }, 400 };
+
 		auto * ct = get_single(req.headers, "content-type");
-		if (ct && *ct == "application/x-gzip")
-		{
-			filter_reader<gzip_filter> gz(*req.body, /*compress=*/false);
-			tarfile_reader tr(gz);
-			go(tr);
-			return 200;
-		}
-		else if (ct && *ct == "application/x-tar")
-		{
-			tarfile_reader tr(*req.body);
-			go(tr);
-			return 200;
-		}
-		else
-		{
+		bool is_gzip = ct && *ct == "application/x-gzip";
+		if (!is_gzip && !(ct && *ct == "application/x-tar"))
 			return 406;
-		}
+
+		// Uploads of a moderate size are inflated in a single call.
+		bool buffered = is_gzip && cl && length <= max_buffered_gzip;
+		std::string gz;
+		if (buffered)
+			gz = req.body->read_all();
+
+		// The files are written off the worker, by a thread that also
+		// reads the rest of a streamed body.
+		bool contained;
+		run_blocking([&] {
+			if (buffered)
+			{
+				std::string tar;
+				if (gunzip_buffer(gz, tar, max_buffered_tar))
+				{
+					g_metrics.gzip_compressed_bytes.add(gz.size());
+					g_metrics.gzip_uncompressed_bytes.add(tar.size());
+
+					memory_istream in(tar);
+					tarfile_reader tr(in);
+					contained = go(tr);
+				}
+				else
+				{
+					memory_istream in(gz);
+					contained = inflate(in);
+				}
+			}
+			else if (is_gzip)
+			{
+				contained = inflate(*req.body);
+			}
+			else if (sock && cl && !get_single(req.headers, "transfer-encoding"))
+			{
+				spliced_body body(*req.body, *sock);
+				tarfile_reader tr(body);
+				contained = go(tr);
+			}
+			else
+			{
+				tarfile_reader tr(*req.body);
+				contained = go(tr);
+			}
+
+			if (!contained)
+				return;
+
+			if (durability == durability_t::batch)
+			{
+				trace_span span("sync_filesystem");
+				sync_filesystem(ws.root);
+			}
+
+			for (auto && dir : dirs)
+				sync_dir(dir);
+		});
+
+		if (!contained)
+			return{ "paths and hard links must stay within the workspace", { { "content-type", "text/plain" } }, 400 };
+
+		return 200;
 	}
 
 	response get_file(request const & req, string_view name)
@@ -207,19 +690,150 @@ struct app
 		return{ std::shared_ptr<istream>(body, &body->in_stream()), { { "content-type", "application/octet-stream" } } };
 	}
 
-	response delete_tree(request const & req)
+	response delete_tree(workspace & ws, request const & req)
 	{
 		std::error_code ec;
-		rmtree(workspace_, ec);
+		run_blocking([&] { rmtree(ws.root, ec); });
 		if (ec)
 			return{ ec.message().c_str(), { { "content-type", "text/plain" } }, 500 };
-		else
-			return 200;
+
+		ws.events.publish("tree", "{\"state\":\"deleted\"}");
+		return 200;
+	}
+
+	// Takes a JSON array of hashes, returns those that aren't in the blob store.
+	response find_missing_blobs(request const & req)
+	{
+		json j;
+		if (!parse_body(req, j))
+			return 400;
+		if (!j.is_array())
+			return 400;
+
+		for (auto && e : j)
+		{
+			if (!e.is_string() || !blob_store::is_valid_hash(e.get_ref<std::string const &>()))
+				return 400;
+		}
+
+		std::string r;
+		json_writer w(r);
+		w.begin_array();
+		run_blocking([&] {
+			for (auto && e : j)
+			{
+				std::string const & hash = e.get_ref<std::string const &>();
+				if (!blobs_.contains(hash))
+					w.value(hash);
+			}
+		});
+		w.end_array();
+
+		return{ std::move(r), { { "content-type", "application/json" } } };
+	}
+
+	response put_blob(request const & req, string_view hash)
+	{
+		if (!blob_store::is_valid_hash(hash))
+			return 404;
+
+		// The body is read by the thread writing the blob.
+		int status;
+		run_blocking([&] {
+			if (blobs_.contains(hash))
+				status = 200;
+			else
+				status = blobs_.put(hash, *req.body)? 201: 400;
+		});
+
+		if (status == 400)
+			return{ "content doesn't match the hash", { { "content-type", "text/plain" } }, 400 };
+
+		return status;
 	}
 
-	response start_exec(request const & req)
+	// Materializes files of the workspace from the blob store.
+	//
+	//     { "files": { "<path>": "<hash>", ... }, "hardlink": false }
+	//
+	// Nothing is written unless all the blobs are present, otherwise
+	// the missing hashes are returned with 409. Hard links are only
+	// made if requested, the client must then never modify the files
+	// in place.
+	response post_tree(workspace & ws, request const & req)
 	{
-		json j = json::parse(req.body->read_all());
+		json j;
+		if (!parse_body(req, j))
+			return 400;
+		if (!j.is_object())
+			return 400;
+
+		auto files = j.find("files");
+		if (files == j.end() || !files->is_object())
+			return 400;
+
+		bool allow_hardlink = false;
+		auto hardlink = j.find("hardlink");
+		if (hardlink != j.end())
+		{
+			if (!hardlink->is_boolean())
+				return 400;
+			allow_hardlink = hardlink->get<bool>();
+		}
+
+		// Paths must stay within the workspace, like the names in POST /tar.
+		for (auto it = files->begin(); it != files->end(); ++it)
+		{
+			if (!is_contained_path(it.key()) || !it.value().is_string())
+				return 400;
+
+			if (!blob_store::is_valid_hash(it.value().get_ref<std::string const &>()))
+				return 400;
+		}
+
+		std::string missing;
+		json_writer w(missing);
+		w.begin_array();
+
+		bool complete = true;
+		run_blocking([&] {
+			for (auto it = files->begin(); it != files->end(); ++it)
+			{
+				std::string const & hash = it.value().get_ref<std::string const &>();
+				if (!blobs_.contains(hash))
+				{
+					w.value(hash);
+					complete = false;
+				}
+			}
+
+			if (!complete)
+				return;
+
+			for (auto it = files->begin(); it != files->end(); ++it)
+			{
+				std::string dst = join_paths(ws.root, it.key());
+
+				size_t sep = dst.find_last_of("/\\");
+				if (sep != std::string::npos && sep != 0)
+					makedirs(string_view(dst).substr(0, sep));
+
+				blobs_.materialize(it.value().get_ref<std::string const &>(), dst, allow_hardlink);
+			}
+		});
+
+		w.end_array();
+		if (!complete)
+			return{ std::move(missing), { { "content-type", "application/json" } }, 409 };
+
+		return 200;
+	}
+
+	response start_exec(workspace & ws, request const & req)
+	{
+		json j;
+		if (!parse_body(req, j))
+			return 400;
 
 		auto cmd = j.find("cmd");
 		if (cmd == j.end() || !cmd->is_array())
@@ -229,83 +843,400 @@ struct app
 		if (pure == j.end() || !pure->is_boolean())
 			return 400;
 
-		proc_info pi;
+		process_options opts;
+		opts.cwd = ws.cwd;
 
-		for (auto && e : *cmd)
+		auto pipe_stdin = j.find("stdin");
+		if (pipe_stdin != j.end())
 		{
-			if (!e.is_string())
+			if (!pipe_stdin->is_boolean())
+				return 400;
+			opts.pipe_stdin = pipe_stdin->get<bool>();
+		}
+
+		auto pi = std::make_shared<proc_info>();
+		if (!parse_string_array(j, "cmd", pi->cmd))
+			return 400;
+
+		// Pure executions that declare their inputs are memoized.
+		std::vector<std::string> inputs, outputs;
+		if (!parse_string_array(j, "inputs", inputs) || !parse_string_array(j, "outputs", outputs))
+			return 400;
+
+		pi->pure = pure->get<bool>();
+
+		// The key hashes the inputs, and a hit copies the outputs;
+		// both are done off the worker.
+		std::string cache_key;
+		bool hit = false;
+		if (pi->pure && j.find("inputs") != j.end() && !opts.pipe_stdin)
+		{
+			pi->output_file = join_paths(output_dir_, new_uuid());
+			opts.output_file = pi->output_file;
+
+			run_blocking([&] {
+				cache_key = cache_.key(pi->cmd, ws.root, ws.cwd.empty()? cwd_: ws.cwd, inputs, outputs);
+				hit = cache_.restore(cache_key, ws.root, outputs, pi->output_file, pi->exit_code);
+			});
+		}
+
+		if (hit)
+		{
+			pi->finished = true;
+			pi->cached = true;
+		}
+		else
+		{
+			pi->proc = std::make_unique<process>();
+			pi->proc->start(pi->cmd, opts);
+			pi->stdin_pending = opts.pipe_stdin;
+			pi->has_waiter = !cache_key.empty();
+		}
+
+		if (!pi->pure)
+			this->set_unpure(ws);
+
+		this->publish_exits(ws, *pi);
+		size_t id = ws.processes.add(pi);
+
+		if (pi->has_waiter)
+			this->store_on_exit(ws, pi, cache_key, std::move(outputs));
+
+		if (!pi->finished)
+		{
+			std::lock_guard<std::mutex> l(ws.mutex);
+			ws.watched.push_back(pi);
+		}
+
+		std::string status = format_exec_status(*pi);
+		ws.events.publish("exec", status);
+
+		return{ std::move(status), {
+			{ "content-type", "application/json" },
+			{ "location", format(FMT("{}exec/{}-{}"), ws.prefix, agent_uuid_, id) },
+		}, 201 };
+	}
+
+	// The outputs must be copied before anyone can tell that the process
+	// has exited, or the client may already be changing them. Pollers
+	// leave the entry alone, it's this thread that records the exit.
+	void store_on_exit(workspace & ws, std::shared_ptr<proc_info> pi, std::string key, std::vector<std::string> outputs)
+	{
+		std::thread([this, &ws, pi, key, outputs] {
+			int32_t exit_code = -1;
+			try
+			{
+				exit_code = pi->proc->wait();
+				cache_.store(key, ws.root, outputs, pi->output_file, exit_code);
+			}
+			catch (...)
+			{
+				// The result just won't be reused.
+			}
+
+			std::lock_guard<std::mutex> l(pi->mutex);
+			finish_exec_locked(*pi, exit_code);
+		}).detach();
+	}
+
+	response start_batch(workspace & ws, request const & req)
+	{
+		json j;
+		if (!parse_body(req, j))
+			return 400;
+
+		auto nodes = j.find("nodes");
+		if (nodes == j.end() || !nodes->is_array())
+			return 400;
+
+		size_t jobs = std::thread::hardware_concurrency();
+		auto jobs_it = j.find("jobs");
+		if (jobs_it != j.end())
+		{
+			if (!jobs_it->is_number_unsigned())
 				return 400;
-			pi.cmd.push_back(e.get<std::string>());
+			jobs = jobs_it->get<size_t>();
 		}
 
-		pi.pure = pure->get<bool>();
-		pi.proc = std::make_unique<process>();
+		std::vector<exec_batch_node> batch;
+		std::vector<std::string> names;
+		std::map<std::string, size_t> indices;
 
-		std::lock_guard<std::mutex> l(mutex_);
-		processes_.push_back(std::move(pi));
+		for (auto && node : *nodes)
+		{
+			auto name = node.find("name");
+			if (name == node.end() || !name->is_string())
+				return 400;
 
-		auto && proc = processes_.back();
-		proc.proc->start(proc.cmd);
+			auto pure = node.find("pure");
+			if (pure == node.end() || !pure->is_boolean())
+				return 400;
 
-		if (!proc.pure)
-			status_ = status_t::unpure;
+			exec_batch_node bn;
+			bn.pi = std::make_shared<proc_info>();
+			bn.pi->pure = pure->get<bool>();
+			if (!parse_string_array(node, "cmd", bn.pi->cmd) || bn.pi->cmd.empty())
+				return 400;
+
+			names.push_back(name->get<std::string>());
+			if (!indices.insert({ names.back(), batch.size() }).second)
+				return 400;
 
-		std::string new_url = format("exec/{}-{}", agent_uuid_, processes_.size() - 1);
-		response resp = this->get_exec(proc, processes_.size() - 1);
-		resp.status_code = 201;
-		resp.headers.push_back({ "location", new_url });
-		return resp;
+			batch.push_back(std::move(bn));
+		}
+
+		// Dependencies may refer to nodes further down the list.
+		size_t idx = 0;
+		for (auto && node : *nodes)
+		{
+			std::vector<std::string> deps;
+			if (!parse_string_array(node, "deps", deps))
+				return 400;
+
+			for (auto && dep : deps)
+			{
+				auto it = indices.find(dep);
+				if (it == indices.end())
+					return 400;
+				batch[idx].deps.push_back(it->second);
+			}
+
+			++idx;
+		}
+
+		if (has_cycle(batch))
+			return 400;
+
+		json r = json::object();
+		for (size_t i = 0; i != batch.size(); ++i)
+		{
+			auto & pi = batch[i].pi;
+			this->publish_exits(ws, *pi);
+			size_t id = ws.processes.add(pi);
+			r["nodes"][names[i]] = format(FMT("{}exec/{}-{}"), ws.prefix, agent_uuid_, id);
+
+			if (!pi->pure)
+				this->set_unpure(ws);
+
+			ws.events.publish("exec", format_exec_status(*pi));
+		}
+
+		process_options opts;
+		opts.cwd = ws.cwd;
+		start_exec_batch(std::move(batch), jobs, opts);
+		return{ r.dump(), { { "content-type", "application/json" } }, 201 };
 	}
 
-	response get_exec(request const & req, std::string_view id)
+	response get_exec(workspace & ws, request const & req, std::string_view id)
 	{
-		if (id.size() < 37 || !starts_with(id, agent_uuid_) || id[36] != '-')
+		long lid = this->parse_exec_id(id);
+		if (lid < 0)
 			return 404;
 
-		id = id.substr(37);
+		auto pi = ws.processes.find(lid);
+		if (pi)
+			return this->get_exec(*pi);
 
-		size_t conv_idx;
-		long lid = std::stoi(id, &conv_idx);
-		if (conv_idx < id.size() || lid >= processes_.size())
+		std::string record;
+		if (ws.processes.find_retired(lid, record))
+			return{ record, { { "content-type", "application/json" } } };
+
+		return 404;
+	}
+
+	response get_exec_output(workspace & ws, request const & req, std::string_view id)
+	{
+		long lid = this->parse_exec_id(id);
+		if (lid < 0)
+			return 404;
+
+		auto pi = ws.processes.find(lid);
+		if (!pi || pi->output_file.empty())
+			return 404;
+
+		return this->get_file(req, pi->output_file);
+	}
+
+	response post_exec_stdin(workspace & ws, request const & req, std::string_view id)
+	{
+		long lid = this->parse_exec_id(id);
+		if (lid < 0)
+			return 404;
+
+		auto pi = ws.processes.find(lid);
+		if (!pi)
 			return 404;
 
-		auto && pi = processes_[lid];
-		return this->get_exec(pi, lid);
+		{
+			std::lock_guard<std::mutex> l(pi->mutex);
+			if (!pi->stdin_pending)
+				return 409;
+			pi->stdin_pending = false;
+		}
+
+		// The pipe provides the backpressure, the body is only read
+		// as fast as the child consumes it; by a thread of its own,
+		// the child may take its time.
+		ostream & child_in = pi->proc->stdin_stream();
+		try
+		{
+			run_blocking([&] { copy(child_in, *req.body); });
+		}
+		catch (...)
+		{
+			child_in.close();
+			throw;
+		}
+
+		child_in.close();
+		return this->get_exec(*pi);
 	}
 
-	response route(request const & req)
+	response get_metrics(request const & req)
 	{
-		if (starts_with(req.path, "/files/") && req.method == "GET")
+		std::string r;
+		format_metrics(r, g_metrics);
+
+		size_t running = 0, pending = 0;
+		for (auto && kv : workspaces_)
+		{
+			size_t ws_running, ws_pending;
+			kv.second->processes.count_live(ws_running, ws_pending);
+			running += ws_running;
+			pending += ws_pending;
+		}
+
+		format_metric(r, "agent_running_processes", "gauge", "Executions whose process is running.", running);
+		format_metric(r, "agent_queued_processes", "gauge", "Batch nodes waiting for their dependencies or a free job slot.", pending);
+
+		return{ std::move(r), { { "content-type", "text/plain; version=0.0.4" } } };
+	}
+
+	response list_workspaces(request const & req)
+	{
+		std::string r;
+		json_writer w(r);
+		w.begin_array();
+		for (auto && kv : workspaces_)
+			w.value(kv.first);
+		w.end_array();
+
+		return{ std::move(r), { { "content-type", "application/json" } } };
+	}
+
+	// Splits `/ws/<name>/rest` into the workspace and `/rest`.
+	workspace * find_workspace(string_view & path)
+	{
+		if (!starts_with(path, "/ws/"))
+			return default_;
+
+		string_view name = path.substr(4);
+		size_t sep = name.find('/');
+		if (sep == string_view::npos)
+			return nullptr;
+
+		auto it = workspaces_.find(name.substr(0, sep));
+		if (it == workspaces_.end())
+			return nullptr;
+
+		path = name.substr(sep);
+		return it->second.get();
+	}
+
+	response route(request const & req, bool head, socket_stream * sock)
+	{
+		string_view path = req.path;
+		if (starts_with(path, "/files/") && req.method == "GET")
 		{
 			return this->get_file(req, req.path.substr(7));
 		}
-		else if (req.path == "/exec/" && req.method == "POST")
+		else if (path == "/blobs/missing" && req.method == "POST")
+		{
+			return this->find_missing_blobs(req);
+		}
+		else if (starts_with(path, "/blobs/") && req.method == "PUT")
+		{
+			return this->put_blob(req, path.substr(7));
+		}
+		else if (path == "/metrics" && req.method == "GET")
+		{
+			return this->get_metrics(req);
+		}
+		else if (path == "/trace" && req.method == "GET")
+		{
+			return{ dump_trace(), { { "content-type", "application/json" } } };
+		}
+		else if (path == "/ws" && req.method == "GET")
+		{
+			return this->list_workspaces(req);
+		}
+
+		workspace * ws = this->find_workspace(path);
+		if (!ws)
+			return 404;
+
+		return this->route_workspace(*ws, req, path, head, sock);
+	}
+
+	response route_workspace(workspace & ws, request const & req, string_view path, bool head, socket_stream * sock)
+	{
+		if (path == "/exec/" && req.method == "POST")
+		{
+			return this->start_exec(ws, req);
+		}
+		else if (path == "/exec/batch" && req.method == "POST")
+		{
+			return this->start_batch(ws, req);
+		}
+		else if (starts_with(path, "/exec/") && (req.method == "GET" || req.method == "POST"))
 		{
-			return this->start_exec(req);
+			string_view id = path;
+			id = id.substr(6);
+
+			string_view sub;
+			size_t sep = id.find('/');
+			if (sep != string_view::npos)
+			{
+				sub = id.substr(sep + 1);
+				id = id.substr(0, sep);
+			}
+
+			if (sub.empty() && req.method == "GET")
+				return this->get_exec(ws, req, id);
+			else if (sub == "output" && req.method == "GET")
+				return this->get_exec_output(ws, req, id);
+			else if (sub == "stdin" && req.method == "POST")
+				return this->post_exec_stdin(ws, req, id);
+			else
+				return 404;
 		}
-		else if (starts_with(req.path, "/exec/") && req.method == "GET")
+		else if (path == "/image" && req.method == "GET")
 		{
-			return this->get_exec(req, req.path.substr(6));
+			return this->get_image(ws, req);
 		}
-		else if (req.path == "/image" && req.method == "GET")
+		else if (path == "/image/stop" && req.method == "POST")
 		{
-			return this->get_image(req);
+			return this->stop_image(ws, req);
 		}
-		else if (req.path == "/image/stop" && req.method == "POST")
+		else if (path == "/tar" && req.method == "GET")
 		{
-			return this->stop_image(req);
+			return this->get_tar(ws, req, head);
 		}
-		else if (req.path == "/tar" && req.method == "GET")
+		else if (path == "/tar" && req.method == "POST")
 		{
-			return this->get_tar(req);
+			return this->post_tar(ws, req, sock);
 		}
-		else if (req.path == "/tar" && req.method == "POST")
+		else if (path == "/tree" && req.method == "DELETE")
 		{
-			return this->post_tar(req);
+			return this->delete_tree(ws, req);
 		}
-		else if (req.path == "/tree" && req.method == "DELETE")
+		else if (path == "/tree" && req.method == "POST")
 		{
-			return this->delete_tree(req);
+			return this->post_tree(ws, req);
+		}
+		else if (path == "/events" && req.method == "GET")
+		{
+			return this->get_events(ws, req, sock);
 		}
 		else
 		{
@@ -313,63 +1244,247 @@ struct app
 		}
 	}
 
-	response operator()(request req)
+	response operator()(request req, socket_stream * sock = nullptr)
 	{
-		if (req.method == "HEAD")
+		bool head = req.method == "HEAD";
+		if (head)
 			req.method = "GET";
-		return this->route(req);
+
+		trace_span span("http_request");
+
+		auto start = std::chrono::steady_clock::now();
+		route_metrics & rm = g_metrics.routes[classify_route(req.path)];
+
+		try
+		{
+			response resp = this->route(req, head, sock);
+			if (resp.status_code >= 500)
+				rm.errors.add();
+
+			// Streamed bodies are timed until they are released.
+			if (resp.body)
+				resp.body = std::make_shared<timed_body>(std::move(resp.body), rm.latency, start);
+			else
+				rm.latency.record_since(start);
+			return resp;
+		}
+		catch (...)
+		{
+			rm.errors.add();
+			rm.latency.record_since(start);
+			throw;
+		}
 	}
 
 private:
 	enum class status_t { clean, dirty, unpure };
 
-	struct proc_info
+public:
+	struct workspace
 	{
-		std::vector<std::string> cmd;
-		bool pure;
-		std::unique_ptr<process> proc;
+		workspace(std::string name, std::string prefix, std::string root, std::string cwd, std::string history_dir)
+			: name(move(name)), prefix(move(prefix)), root(move(root)), cwd(move(cwd)), status(status_t::clean), processes(move(history_dir))
+		{
+		}
+
+		std::string name;
+
+		// Prepended to the paths of the URLs handed out, `ws/<name>/`
+		// or empty for the default workspace.
+		std::string prefix;
+
+		std::string root;
+
+		// Where executions start; the agent's own directory if empty.
+		std::string cwd;
+
+		std::mutex mutex;
+		status_t status;
+
+		exec_registry processes;
+		event_bus events;
+
+		// Executions whose exits haven't been observed yet.
+		std::vector<std::weak_ptr<proc_info>> watched;
 	};
 
-	response get_exec(proc_info const & pi, size_t id)
+private:
+	static size_t const max_buffered_gzip = 16 * 1024 * 1024;
+	static size_t const max_buffered_tar = 64 * 1024 * 1024;
+	static size_t const max_json_depth = 64;
+
+	struct timed_body final
+		: istream
 	{
-		if (!pi.proc->poll())
+		timed_body(std::shared_ptr<istream> body, histogram & h, std::chrono::steady_clock::time_point start)
+			: body_(std::move(body)), h_(h), start_(start)
 		{
-			json r = {
-				{ "id", id },
-				{ "command", pi.cmd },
-				{ "exit_code", json() },
-				{ "pure", pi.pure },
-			};
+		}
 
-			return{ r.dump(), { { "content-type", "application/json" } } };
+		~timed_body()
+		{
+			h_.record_since(start_);
 		}
-		else
+
+		size_t read(char * buf, size_t len) override
+		{
+			return body_->read(buf, len);
+		}
+
+	private:
+		std::shared_ptr<istream> body_;
+		histogram & h_;
+		std::chrono::steady_clock::time_point start_;
+	};
+
+	// The body of a plain HTTP/1.1 request with a content-length, whose
+	// bytes follow one another on the socket. Spliced bytes come back
+	// through libhttp as zeros, which are dropped here.
+	struct spliced_body final
+		: istream, splice_source
+	{
+		spliced_body(istream & body, socket_stream & sock)
+			: body_(body), sock_(sock), skipped_(0)
+		{
+		}
+
+		size_t read(char * buf, size_t len) override
+		{
+			while (skipped_ != 0)
+			{
+				size_t r = body_.read(buf, len < skipped_? len: (size_t)skipped_);
+				if (r == 0)
+					throw std::runtime_error("premature end of stream");
+				skipped_ -= r;
+			}
+
+			return body_.read(buf, len);
+		}
+
+		void splice_to(file & f, uint64_t len) override
+		{
+			// libhttp may have read part of the body ahead. That's taken
+			// through the stream until a read reaches the socket; with
+			// reads of the socket capped at a byte, nothing is left above
+			// it afterwards.
+			char buf[4096];
+
+			sock_.limit_reads(1);
+			try
+			{
+				while (len != 0)
+				{
+					uint64_t received = sock_.received();
+
+					size_t r = this->read(buf, len < sizeof buf? (size_t)len: sizeof buf);
+					if (r == 0)
+						throw std::runtime_error("premature end of stream");
+
+					f.out_stream().write_all(buf, r);
+					len -= r;
+
+					if (sock_.received() != received)
+						break;
+				}
+			}
+			catch (...)
+			{
+				sock_.limit_reads(0);
+				throw;
+			}
+
+			sock_.limit_reads(0);
+
+			f.splice_from(sock_, len);
+			skipped_ += len;
+		}
+
+	private:
+		istream & body_;
+		socket_stream & sock_;
+		uint64_t skipped_;
+	};
+
+	static agent_metrics::route_t classify_route(std::string_view path)
+	{
+		// Routes of named workspaces count with those of the default one.
+		if (starts_with(path, "/ws/"))
 		{
-			json r = {
-				{ "id", id },
-				{ "command", pi.cmd },
-				{ "exit_code", pi.proc->exit_code() },
-				{ "pure", pi.pure },
-			};
+			size_t sep = path.find('/', 4);
+			path = sep == std::string_view::npos? std::string_view(): path.substr(sep);
+		}
+
+		if (path == "/tar")
+			return agent_metrics::route_tar;
+		if (starts_with(path, "/files/"))
+			return agent_metrics::route_files;
+		if (starts_with(path, "/exec/"))
+			return agent_metrics::route_exec;
+		if (starts_with(path, "/image"))
+			return agent_metrics::route_image;
+		if (path == "/tree")
+			return agent_metrics::route_tree;
+		return agent_metrics::route_other;
+	}
+
+	static bool parse_string_array(json const & j, char const * key, std::vector<std::string> & r)
+	{
+		auto it = j.find(key);
+		if (it == j.end())
+			return true;
+
+		if (!it->is_array())
+			return false;
 
-			return{ r.dump(), { { "content-type", "application/json" } } };
+		for (auto && e : *it)
+		{
+			if (!e.is_string())
+				return false;
+			r.push_back(e.get<std::string>());
 		}
+
+		return true;
 	}
 
-	std::mutex mutex_;
+	long parse_exec_id(std::string_view id)
+	{
+		if (id.size() < 37 || !starts_with(id, agent_uuid_) || id[36] != '-')
+			return -1;
+
+		id = id.substr(37);
+
+		size_t conv_idx;
+		long lid = std::stoi(id, &conv_idx);
+		if (conv_idx < id.size())
+			return -1;
+
+		return lid;
+	}
+
+	response get_exec(proc_info & pi)
+	{
+		return{ format_exec_status(pi), { { "content-type", "application/json" } } };
+	}
 
 	std::string state_file_;
+
+	// Where executions of workspaces without a directory of their own start.
+	std::string cwd_;
 	std::string agent_uuid_;
 	size_t session_count_;
 
-	status_t status_;
-	std::string workspace_;
 	std::string image_name_;
 	std::string stop_cmd_;
 	int32_t error_;
 	bool stopping_;
 
-	std::vector<proc_info> processes_;
+	exec_cache cache_;
+	blob_store blobs_;
+	std::string output_dir_;
+
+	// Created up front and never removed, lookups need no lock.
+	std::map<std::string, std::unique_ptr<workspace>, std::less<>> workspaces_;
+	workspace * default_;
 };
 
 int main(int argc, char * argv[])
@@ -378,35 +1493,106 @@ int main(int argc, char * argv[])
 	std::string stop_cmd;
 	std::string tls_key, tls_cert;
 	std::string workspace;
+	std::string workspaces;
 	int port = 8080;
+	bool zygote = false;
+	bool trace = false;
+	int reactors = 0;
+	int workers = 16;
+	int max_connections = 0;
+	int cache_size_mb = 1024;
 
 	parse_argv(argc, argv, {
 		{ port, "--port", 'p' },
+		{ zygote, "--zygote" },
+		{ trace, "--trace" },
+		{ reactors, "--reactors" },
+		{ workers, "--workers" },
+		{ max_connections, "--max-connections" },
+		{ cache_size_mb, "--cache-size-mb" },
 		{ stop_cmd, "--stop-cmd" },
 		{ tls_key, "--tls-key" },
 		{ tls_cert, "--tls-cert" },
+		{ workspaces, "--workspaces" },
 		{ image_name, "image-name" },
 		{ workspace, "workspace" },
 	});
 
-	app a(workspace, image_name, stop_cmd);
+	if (zygote)
+		start_process_launcher();
+
+	if (trace)
+	{
+		enable_tracing(true);
+		dump_trace_on_signal(get_appdata_dir() + "/remote_test_agent.trace.json");
+	}
+
+	// `--workspaces name=dir,name=dir` adds named workspaces.
+	std::vector<std::pair<std::string, std::string>> named;
+	for (string_view rest = workspaces; !rest.empty(); )
+	{
+		size_t sep = rest.find(',');
+		string_view item = rest.substr(0, sep);
+		rest = sep == string_view::npos? string_view(): rest.substr(sep + 1);
+
+		size_t eq = item.find('=');
+		string_view name = item.substr(0, eq);
+		if (eq == string_view::npos || name.empty() || name.find('/') != string_view::npos)
+		{
+			std::cerr << "error: --workspaces expects name=dir[,name=dir...]\n";
+			return 2;
+		}
+
+		named.emplace_back(std::string(name), std::string(item.substr(eq + 1)));
+	}
+
+	app a(workspace, named, image_name, stop_cmd, (uint64_t)cache_size_mb * 1024 * 1024);
+
+	std::function<void(istream & in, ostream & out)> handler;
 	if (tls_key.empty() || tls_cert.empty())
 	{
-		tcp_listen(port, [&a](istream & in, ostream & out) {
-			http_server(in, out, std::ref(a));
-		});
+		handler = [&a](istream & in, ostream & out) {
+			g_metrics.connections.add();
+			gauge_scope open(g_metrics.open_connections);
+
+			counting_istream cin(in, g_metrics.bytes_in);
+			counting_ostream cout(out, g_metrics.bytes_out);
+
+			// Set in reactor mode only.
+			auto * sock = dynamic_cast<socket_stream *>(&in);
+			http_server(cin, cout, [&a, sock](request req) { return a(std::move(req), sock); });
+		};
 	}
 	else
 	{
-		tcp_listen(port, [&a, &tls_key, &tls_cert](istream & in, ostream & out) {
+		handler = [&a, &tls_key, &tls_cert](istream & in, ostream & out) {
+			g_metrics.connections.add();
+			gauge_scope open(g_metrics.open_connections);
+
 			std::shared_ptr<istream> in_tls;
 			std::shared_ptr<ostream> out_tls;
 			std::string proto = tls_server(in_tls, out_tls, in, out, tls_key, tls_cert, { "h2", "http/1.1" });
 
+			counting_istream cin(*in_tls, g_metrics.bytes_in);
+			counting_ostream cout(*out_tls, g_metrics.bytes_out);
+
 			if (proto != "h2")
-				http_server(*in_tls, *out_tls, std::ref(a));
+				http_server(cin, cout, std::ref(a));
 			else
-				http2_server(*in_tls, *out_tls, std::ref(a));
-		});
+				http2_server(cin, cout, std::ref(a));
+		};
+	}
+
+	if (reactors > 0)
+	{
+		server_options opts;
+		opts.reactors = reactors;
+		opts.workers = workers;
+		opts.max_connections = max_connections;
+		reactor_listen(port, opts, std::move(handler));
+	}
+	else
+	{
+		tcp_listen(port, std::move(handler));
 	}
 }
@@ -0,0 +1,87 @@
+#include "metrics.hpp"
+#include "format.hpp"
+#include <stdio.h>
+
+agent_metrics g_metrics;
+
+static char const * const g_route_names[agent_metrics::route_count] = {
+	"/tar", "/files", "/exec", "/image", "/tree", "other",
+};
+
+static void format_header(std::string & out, std::string_view name, std::string_view type, std::string_view help)
+{
+	format_to(out, FMT("# HELP {} {}\n# TYPE {} {}\n"), name, help, name, type);
+}
+
+// Scrapers keep a series per exported bucket, so the fine buckets are
+// merged into every other power of two of microseconds, from 64 us to
+// 2^32 us, where the last bucket starts; these are bounds of fine
+// buckets, the counts stay exact.
+static unsigned const g_export_first_shift = 6;
+static unsigned const g_export_last_shift = 32;
+static unsigned const g_export_step = 2;
+
+static void format_histogram(std::string & out, std::string_view name, std::string_view labels, histogram const & h)
+{
+	std::string_view sep = labels.empty()? "": ",";
+
+	uint64_t count = 0;
+	size_t i = 0;
+	for (unsigned shift = g_export_first_shift; shift <= g_export_last_shift; shift += g_export_step)
+	{
+		uint64_t bound = (uint64_t)1 << shift;
+		for (; i + 1 < histogram::bucket_count && histogram::bucket_bound(i) <= bound; ++i)
+			count += h.bucket(i);
+
+		// Bucket bounds are exported in seconds.
+		char le[32];
+		snprintf(le, sizeof le, "%.6f", (double)bound / 1e6);
+		format_to(out, FMT("{}_bucket{{}{}le=\"{}\"} {}\n"), name, labels, sep, le, count);
+	}
+
+	for (; i < histogram::bucket_count; ++i)
+		count += h.bucket(i);
+	format_to(out, FMT("{}_bucket{{}{}le=\"+Inf\"} {}\n"), name, labels, sep, count);
+
+	char sum[32];
+	snprintf(sum, sizeof sum, "%.6f", (double)h.sum() / 1e6);
+
+	if (labels.empty())
+	{
+		format_to(out, FMT("{}_sum {}\n"), name, sum);
+		format_to(out, FMT("{}_count {}\n"), name, count);
+	}
+	else
+	{
+		format_to(out, FMT("{}_sum{{}} {}\n"), name, labels, sum);
+		format_to(out, FMT("{}_count{{}} {}\n"), name, labels, count);
+	}
+}
+
+void format_metric(std::string & out, std::string_view name, std::string_view type, std::string_view help, int64_t value)
+{
+	format_header(out, name, type, help);
+	format_to(out, FMT("{} {}\n"), name, value);
+}
+
+void format_metrics(std::string & out, agent_metrics const & m)
+{
+	format_header(out, "agent_request_duration_seconds", "histogram", "Time from receiving a request to sending the last byte of its response.");
+	for (size_t i = 0; i < agent_metrics::route_count; ++i)
+		format_histogram(out, "agent_request_duration_seconds", format(FMT("route=\"{}\""), g_route_names[i]), m.routes[i].latency);
+
+	format_header(out, "agent_request_errors_total", "counter", "Requests that failed with a 5xx status or an exception.");
+	for (size_t i = 0; i < agent_metrics::route_count; ++i)
+		format_to(out, FMT("agent_request_errors_total{route=\"{}\"} {}\n"), g_route_names[i], m.routes[i].errors.get());
+
+	format_metric(out, "agent_received_bytes_total", "counter", "HTTP bytes read from clients, after TLS decryption.", m.bytes_in.get());
+	format_metric(out, "agent_sent_bytes_total", "counter", "HTTP bytes written to clients, before TLS encryption.", m.bytes_out.get());
+	format_metric(out, "agent_gzip_compressed_bytes_total", "counter", "Compressed bytes passed through gzip filters.", m.gzip_compressed_bytes.get());
+	format_metric(out, "agent_gzip_uncompressed_bytes_total", "counter", "Uncompressed bytes passed through gzip filters.", m.gzip_uncompressed_bytes.get());
+	format_metric(out, "agent_connections_total", "counter", "Accepted client connections.", m.connections.get());
+	format_metric(out, "agent_open_connections", "gauge", "Client connections being served.", m.open_connections.get());
+
+	format_header(out, "agent_tls_handshake_duration_seconds", "histogram", "Duration of successful TLS handshakes.");
+	format_histogram(out, "agent_tls_handshake_duration_seconds", "", m.tls_handshake);
+	format_metric(out, "agent_tls_handshake_failures_total", "counter", "Failed TLS handshakes.", m.tls_handshake_failures.get());
+}
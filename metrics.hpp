@@ -0,0 +1,212 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "stream.hpp"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <stdint.h>
+
+// Counters and histograms are updated with relaxed atomic adds
+// and never take a lock; a scrape may see them mid-update.
+
+struct counter
+{
+	void add(uint64_t n = 1) noexcept
+	{
+		value_.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	uint64_t get() const noexcept
+	{
+		return value_.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> value_{ 0 };
+};
+
+struct gauge
+{
+	void add(int64_t n) noexcept
+	{
+		value_.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	int64_t get() const noexcept
+	{
+		return value_.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<int64_t> value_{ 0 };
+};
+
+struct gauge_scope
+{
+	explicit gauge_scope(gauge & g) noexcept
+		: g_(g)
+	{
+		g_.add(1);
+	}
+
+	~gauge_scope()
+	{
+		g_.add(-1);
+	}
+
+	gauge_scope(gauge_scope const &) = delete;
+	gauge_scope & operator=(gauge_scope const &) = delete;
+
+private:
+	gauge & g_;
+};
+
+// Latencies in microseconds, HDR-style: every power of two is split
+// into `sub_buckets` linear buckets, so a bucket's width is at most
+// an eighth of its lower bound and so is the error of a quantile.
+// Values below `sub_buckets` have a bucket each. The last bucket
+// collects everything from 2^32 us, over an hour, up.
+struct histogram
+{
+	static constexpr size_t sub_bucket_bits = 3;
+	static constexpr size_t sub_buckets = 1 << sub_bucket_bits;
+	static constexpr size_t bucket_count = (33 - sub_bucket_bits) * sub_buckets + 1;
+
+	static size_t bucket_index(uint64_t us) noexcept
+	{
+		if (us < sub_buckets)
+			return (size_t)us;
+
+#ifdef __GNUC__
+		size_t width = 64 - __builtin_clzll(us);
+#else
+		size_t width = 0;
+		while ((us >> width) != 0)
+			++width;
+#endif
+
+		// The power of two picks the row, the bits below the leading one the column.
+		size_t shift = width - sub_bucket_bits - 1;
+		size_t idx = (width - sub_bucket_bits) * sub_buckets + (size_t)((us >> shift) - sub_buckets);
+		return idx < bucket_count? idx: bucket_count - 1;
+	}
+
+	// Values in the bucket `idx` are less than this, except in the last one.
+	static uint64_t bucket_bound(size_t idx) noexcept
+	{
+		if (idx < sub_buckets)
+			return idx + 1;
+
+		size_t row = idx / sub_buckets;
+		uint64_t col = idx % sub_buckets;
+		return (sub_buckets + col + 1) << (row - 1);
+	}
+
+	void record(uint64_t us) noexcept
+	{
+		buckets_[bucket_index(us)].fetch_add(1, std::memory_order_relaxed);
+		sum_.fetch_add(us, std::memory_order_relaxed);
+	}
+
+	void record_since(std::chrono::steady_clock::time_point start) noexcept
+	{
+		auto d = std::chrono::steady_clock::now() - start;
+		this->record(std::chrono::duration_cast<std::chrono::microseconds>(d).count());
+	}
+
+	uint64_t bucket(size_t idx) const noexcept
+	{
+		return buckets_[idx].load(std::memory_order_relaxed);
+	}
+
+	uint64_t sum() const noexcept
+	{
+		return sum_.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> buckets_[bucket_count] = {};
+	std::atomic<uint64_t> sum_{ 0 };
+};
+
+struct route_metrics
+{
+	histogram latency;
+	counter errors;
+};
+
+struct agent_metrics
+{
+	enum route_t { route_tar, route_files, route_exec, route_image, route_tree, route_other, route_count };
+	route_metrics routes[route_count];
+
+	counter bytes_in;
+	counter bytes_out;
+
+	// Bytes on either side of the gzip filter, their ratio is the compression ratio.
+	counter gzip_compressed_bytes;
+	counter gzip_uncompressed_bytes;
+
+	counter connections;
+	gauge open_connections;
+
+	histogram tls_handshake;
+	counter tls_handshake_failures;
+};
+
+extern agent_metrics g_metrics;
+
+// Appends the metrics in the Prometheus text format.
+void format_metrics(std::string & out, agent_metrics const & m);
+void format_metric(std::string & out, std::string_view name, std::string_view type, std::string_view help, int64_t value);
+
+// Counts the bytes passing through a stream.
+struct counting_istream final
+	: istream
+{
+	counting_istream(istream & in, counter & c)
+		: in_(in), counter_(c)
+	{
+	}
+
+	size_t read(char * buf, size_t len) override
+	{
+		size_t r = in_.read(buf, len);
+		counter_.add(r);
+		return r;
+	}
+
+private:
+	istream & in_;
+	counter & counter_;
+};
+
+struct counting_ostream final
+	: ostream
+{
+	counting_ostream(ostream & out, counter & c)
+		: out_(out), counter_(c)
+	{
+	}
+
+	size_t write(char const * buf, size_t len) override
+	{
+		size_t r = out_.write(buf, len);
+		counter_.add(r);
+		return r;
+	}
+
+	void close() override
+	{
+		out_.close();
+	}
+
+private:
+	ostream & out_;
+	counter & counter_;
+};
+
+#endif // METRICS_HPP
@@ -1,7 +1,97 @@
 #include "chan.hpp"
+#include "coro.hpp"
+#include <memory>
+#include <stdexcept>
+#include <string.h>
+
+namespace {
+
+// Runs the writer on its own stack. Each `read` resumes the writer,
+// which copies straight into the reader's buffer and yields back.
+struct chan final
+	: istream, private ostream
+{
+	explicit chan(std::function<void(ostream & out)> fn);
+	~chan();
+	chan(chan && o) = delete;
+	chan & operator=(chan && o) = delete;
+
+	size_t read(char * buf, size_t len) override;
+
+private:
+	std::function<void(ostream & out)> fn_;
+	std::unique_ptr<coroutine> coro_;
+	char * rd_buf_;
+	size_t rd_len_;
+
+	size_t write(char const * buf, size_t len) override;
+};
+
+}
+
+chan::chan(std::function<void(ostream & out)> fn)
+	: fn_(std::move(fn)), rd_buf_(nullptr), rd_len_(0)
+{
+}
+
+chan::~chan()
+{
+	if (coro_ && !coro_->done())
+	{
+		// The reader went away; the next write fails,
+		// which unwinds the writer's stack.
+		rd_buf_ = nullptr;
+		rd_len_ = 0;
+
+		try
+		{
+			coro_->resume();
+		}
+		catch (...)
+		{
+		}
+	}
+}
+
+size_t chan::read(char * buf, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+	if (!coro_)
+		coro_.reset(new coroutine([this] { fn_(*this); }));
+
+	if (coro_->done())
+		return 0;
+
+	rd_buf_ = buf;
+	rd_len_ = len;
+	coro_->resume();
+
+	// The writer either wrote into the buffer, or returned.
+	return coro_->done()? 0: rd_len_;
+}
+
+size_t chan::write(char const * buf, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+	if (rd_len_ == 0)
+		throw std::runtime_error("epipe");
+
+	if (rd_len_ < len)
+		len = rd_len_;
+
+	memcpy(rd_buf_, buf, len);
+	rd_len_ = len;
+
+	coroutine::yield();
+	return len;
+}
 
 std::shared_ptr<istream> make_istream(std::function<void(ostream & out)> fn)
 {
-	// XXX
-	return nullptr;
+	auto px = std::make_shared<chan>(std::move(fn));
+	return std::shared_ptr<istream>(px, px.get());
 }
@@ -0,0 +1,185 @@
+#include "coro.hpp"
+#include <cassert>
+#include <exception>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <vector>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Connection handlers parse TLS records and tar headers on their stack.
+static size_t const g_stack_size = 256 * 1024;
+
+// Stacks of finished coroutines are kept for reuse, mapping a fresh one
+// costs a few syscalls and page faults for every connection and stream.
+static size_t const g_max_pooled_stacks = 64;
+
+static std::mutex g_stack_pool_mutex;
+static std::vector<void *> g_stack_pool;
+
+static size_t page_size()
+{
+	static size_t const r = sysconf(_SC_PAGESIZE);
+	return r;
+}
+
+// Returns the usable part of a stack; the page below it is
+// left inaccessible, so that an overflow faults instead of
+// silently corrupting the neighbouring mapping.
+static void * alloc_stack()
+{
+	{
+		std::lock_guard<std::mutex> l(g_stack_pool_mutex);
+		if (!g_stack_pool.empty())
+		{
+			void * r = g_stack_pool.back();
+			g_stack_pool.pop_back();
+			return r;
+		}
+	}
+
+	size_t guard = page_size();
+	void * p = mmap(nullptr, g_stack_size + guard, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (p == MAP_FAILED)
+		throw std::bad_alloc();
+
+	if (mprotect(p, guard, PROT_NONE) == -1)
+	{
+		munmap(p, g_stack_size + guard);
+		throw std::bad_alloc();
+	}
+
+	return static_cast<char *>(p) + guard;
+}
+
+static void free_stack(void * stack)
+{
+	{
+		std::lock_guard<std::mutex> l(g_stack_pool_mutex);
+		if (g_stack_pool.size() < g_max_pooled_stacks)
+		{
+			g_stack_pool.push_back(stack);
+			return;
+		}
+	}
+
+	size_t guard = page_size();
+	munmap(static_cast<char *>(stack) - guard, g_stack_size + guard);
+}
+
+struct coroutine::impl
+{
+	std::function<void()> body;
+	ucontext_t ctx;
+	ucontext_t caller;
+	void * stack;
+	bool done;
+	bool cancelled;
+	std::exception_ptr err;
+
+	static void entry(unsigned lo, unsigned hi);
+	static thread_local impl * current;
+};
+
+thread_local coroutine::impl * coroutine::impl::current = nullptr;
+
+void coroutine::impl::entry(unsigned lo, unsigned hi)
+{
+	impl * self = reinterpret_cast<impl *>(((uintptr_t)hi << 32) | lo);
+
+	try
+	{
+		self->body();
+	}
+	catch (...)
+	{
+		self->err = std::current_exception();
+	}
+
+	self->done = true;
+	// Returning switches to `uc_link`, which is `caller`.
+}
+
+coroutine::coroutine(std::function<void()> body)
+	: pimpl_(new impl())
+{
+	pimpl_->body = std::move(body);
+	pimpl_->done = false;
+	pimpl_->cancelled = false;
+
+	try
+	{
+		pimpl_->stack = alloc_stack();
+	}
+	catch (...)
+	{
+		delete pimpl_;
+		throw;
+	}
+
+	getcontext(&pimpl_->ctx);
+	pimpl_->ctx.uc_stack.ss_sp = pimpl_->stack;
+	pimpl_->ctx.uc_stack.ss_size = g_stack_size;
+	pimpl_->ctx.uc_link = &pimpl_->caller;
+
+	uintptr_t p = reinterpret_cast<uintptr_t>(pimpl_);
+	makecontext(&pimpl_->ctx, (void (*)())&impl::entry, 2, (unsigned)p, (unsigned)((uint64_t)p >> 32));
+}
+
+coroutine::~coroutine()
+{
+	// A suspended body is abandoned, its stack is not unwound;
+	// `cancel` it first.
+	free_stack(pimpl_->stack);
+	delete pimpl_;
+}
+
+void coroutine::resume()
+{
+	assert(!pimpl_->done);
+
+	impl * prev = impl::current;
+	impl::current = pimpl_;
+	swapcontext(&pimpl_->caller, &pimpl_->ctx);
+	impl::current = prev;
+
+	if (pimpl_->err)
+	{
+		auto err = std::move(pimpl_->err);
+		pimpl_->err = nullptr;
+		std::rethrow_exception(err);
+	}
+}
+
+bool coroutine::done() const
+{
+	return pimpl_->done;
+}
+
+void coroutine::cancel()
+{
+	assert(!pimpl_->done);
+	pimpl_->cancelled = true;
+	this->resume();
+}
+
+void coroutine::yield()
+{
+	impl * self = impl::current;
+	assert(self);
+
+	// A cancelled body doesn't get to suspend again.
+	if (!self->cancelled)
+		swapcontext(&self->ctx, &self->caller);
+
+	if (self->cancelled)
+		throw std::system_error(std::make_error_code(std::errc::operation_canceled));
+}
+
+bool coroutine::in_coroutine()
+{
+	return impl::current != nullptr;
+}
@@ -1,4 +1,7 @@
 #include "file.hpp"
+#include "server.hpp"
+#include "trace.hpp"
+#include <cassert>
 #include <memory>
 #include <stdexcept>
 
@@ -7,6 +10,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 struct file::impl final
 	: istream, ostream
@@ -88,8 +99,10 @@ void file::open_ro(std::string_view name, std::error_code & ec) noexcept
 
 void file::create(std::string_view name)
 {
+	trace_span span("file::create");
+
 	std::unique_ptr<impl> pimpl(new impl());
-	pimpl->fd = open(std::string(name).c_str(), O_CREAT | O_RDWR, 0666);
+	pimpl->fd = open(std::string(name).c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
 	if (pimpl->fd < 0)
 		throw std::system_error(errno, std::system_category());
 
@@ -97,6 +110,29 @@ void file::create(std::string_view name)
 	pimpl_ = pimpl.release();
 }
 
+void file::create_temporary(std::string_view dir)
+{
+	std::unique_ptr<impl> pimpl(new impl());
+
+	// Files without a name to begin with, where the filesystem supports them.
+	pimpl->fd = -1;
+#ifdef O_TMPFILE
+	pimpl->fd = open(std::string(dir).c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+
+	if (pimpl->fd < 0)
+	{
+		std::string name = join_paths(dir, "remote_test_agent.XXXXXX");
+		pimpl->fd = mkstemp(&name[0]);
+		if (pimpl->fd < 0)
+			throw std::system_error(errno, std::system_category());
+		::unlink(name.c_str());
+	}
+
+	this->close();
+	pimpl_ = pimpl.release();
+}
+
 void file::close()
 {
 	if (pimpl_ != nullptr)
@@ -125,6 +161,144 @@ uint64_t file::mtime()
 	return st.st_mtime;
 }
 
+file_version file::version()
+{
+	assert(pimpl_);
+
+	struct stat st;
+	if (fstat(pimpl_->fd, &st) < 0)
+		throw std::system_error(errno, std::system_category());
+
+	file_version r;
+	r.mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	r.ctime_ns = (uint64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+	r.dev = st.st_dev;
+	r.ino = st.st_ino;
+	return r;
+}
+
+bool file::link_id(std::pair<uint64_t, uint64_t> & id)
+{
+	assert(pimpl_);
+
+	struct stat st;
+	if (fstat(pimpl_->fd, &st) < 0)
+		throw std::system_error(errno, std::system_category());
+
+	if (st.st_nlink < 2)
+		return false;
+
+	id = { (uint64_t)st.st_dev, (uint64_t)st.st_ino };
+	return true;
+}
+
+void file::sync()
+{
+	assert(pimpl_);
+
+	if (::fsync(pimpl_->fd) < 0)
+		throw std::system_error(errno, std::system_category());
+}
+
+size_t file::read_at(uint64_t offset, char * buf, size_t len)
+{
+	assert(pimpl_);
+
+	ssize_t r;
+	while ((r = ::pread(pimpl_->fd, buf, len, (off_t)offset)) < 0 && errno == EINTR)
+	{
+	}
+
+	if (r < 0)
+		throw std::system_error(errno, std::system_category());
+	return r;
+}
+
+// Also the default capacity of a pipe.
+static size_t const g_splice_chunk = 64 * 1024;
+
+void file::splice_from(socket_stream & sock, uint64_t len)
+{
+	assert(pimpl_);
+
+	int sfd = sock.native_handle();
+
+#ifdef __linux__
+	// Pages go from the socket to the pipe and on to the file; the pipe
+	// is emptied every round, so it never fills up.
+	int pipefd[2];
+	if (::pipe2(pipefd, O_CLOEXEC) < 0)
+		throw std::system_error(errno, std::system_category());
+
+	try
+	{
+		while (len != 0)
+		{
+			size_t chunk = len < g_splice_chunk? (size_t)len: g_splice_chunk;
+			ssize_t r = ::splice(sfd, nullptr, pipefd[1], nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (r == 0)
+				throw std::runtime_error("premature end of stream");
+
+			if (r < 0)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					sock.wait_ready(false);
+				else if (errno != EINTR)
+					throw std::system_error(errno, std::system_category());
+				continue;
+			}
+
+			sock.skip(r);
+			len -= r;
+
+			while (r != 0)
+			{
+				ssize_t w = ::splice(pipefd[0], nullptr, pimpl_->fd, nullptr, r, SPLICE_F_MOVE);
+				if (w < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					throw std::system_error(errno, std::system_category());
+				}
+
+				r -= w;
+			}
+		}
+	}
+	catch (...)
+	{
+		::close(pipefd[0]);
+		::close(pipefd[1]);
+		throw;
+	}
+
+	::close(pipefd[0]);
+	::close(pipefd[1]);
+#else
+	std::unique_ptr<char[]> buf(new char[g_splice_chunk]);
+	while (len != 0)
+	{
+		size_t chunk = len < g_splice_chunk? (size_t)len: g_splice_chunk;
+		ssize_t r = ::recv(sfd, buf.get(), chunk, 0);
+		if (r == 0)
+			throw std::runtime_error("premature end of stream");
+
+		if (r < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				sock.wait_ready(false);
+			else if (errno != EINTR)
+				throw std::system_error(errno, std::system_category());
+			continue;
+		}
+
+		sock.skip(r);
+		len -= r;
+		pimpl_->write_all(buf.get(), r);
+	}
+#endif
+}
+
 istream & file::in_stream()
 {
 	return *pimpl_;
@@ -150,28 +324,52 @@ struct dir_guard
 	}
 };
 
-static void enum_files_impl(std::string const & top, DIR * dir, std::function<void(std::string_view fname)> const & cb)
+static bool is_dot_or_dotdot(char const * name);
+
+static void enum_files_impl(std::string & top, size_t prefix_len, DIR * dir, std::function<void(std::string_view fname)> const & cb)
 {
 	for (;;)
 	{
+		errno = 0;
 		struct dirent * de = readdir(dir);
 		if (!de)
+		{
+			if (errno != 0)
+				throw std::system_error(errno, std::system_category());
 			break;
+		}
 
-		std::string n = top;
-		n.append("/");
-		n.append(de->d_name);
+		if (is_dot_or_dotdot(de->d_name))
+			continue;
 
-		DIR * subdir = opendir(n.c_str());
-		if (!subdir)
+		size_t prev_len = top.size();
+		top.append("/");
+		top.append(de->d_name);
+
+		bool is_dir = de->d_type == DT_DIR;
+		if (de->d_type == DT_UNKNOWN)
 		{
-			if (errno == ENOTDIR)
-				cb(n);
-			throw std::system_error(errno, std::system_category());
+			struct stat st;
+			if (lstat(top.c_str(), &st) == -1)
+				throw std::system_error(errno, std::system_category());
+			is_dir = S_ISDIR(st.st_mode);
+		}
+
+		if (is_dir)
+		{
+			DIR * subdir = opendir(top.c_str());
+			if (!subdir)
+				throw std::system_error(errno, std::system_category());
+
+			dir_guard subdir_guard(subdir);
+			enum_files_impl(top, prefix_len, subdir, cb);
+		}
+		else
+		{
+			cb(std::string_view(top).substr(prefix_len + 1));
 		}
 
-		dir_guard subdir_guard(subdir);
-		enum_files_impl(n, subdir, cb);
+		top.resize(prev_len);
 	}
 }
 
@@ -180,10 +378,14 @@ void enum_files(std::string_view top, std::function<void(std::string_view fname)
 	std::string t(top);
 	DIR * dir = opendir(t.c_str());
 	if (!dir)
+	{
+		if (errno == ENOENT)
+			return;
 		throw std::system_error(errno, std::system_category());
+	}
 
 	dir_guard dg(dir);
-	enum_files_impl(t, dir, cb);
+	enum_files_impl(t, t.size(), dir, cb);
 }
 
 std::string join_paths(std::string_view lhs, std::string_view rhs)
@@ -194,6 +396,11 @@ std::string join_paths(std::string_view lhs, std::string_view rhs)
 	return r;
 }
 
+static bool is_dot_or_dotdot(char const * name)
+{
+	return name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+}
+
 static void rmtree_impl(std::string const & top, DIR * dir, std::error_code & ec) noexcept
 {
 	for (;;)
@@ -202,25 +409,38 @@ static void rmtree_impl(std::string const & top, DIR * dir, std::error_code & ec
 		if (!de)
 			return;
 
+		if (is_dot_or_dotdot(de->d_name))
+			continue;
+
 		std::string n = top;
 		n.append("/");
 		n.append(de->d_name);
 
-		DIR * subdir = opendir(n.c_str());
-		if (!subdir)
+		// Symlinks are removed, never followed.
+		struct stat st;
+		if (lstat(n.c_str(), &st) < 0)
+			return ec.assign(errno, std::system_category());
+
+		if (!S_ISDIR(st.st_mode))
 		{
-			if (errno == ENOTDIR)
-				unlink(n.c_str());
-			else
+			if (unlink(n.c_str()) < 0)
 				return ec.assign(errno, std::system_category());
+			continue;
 		}
 
-		dir_guard subdir_guard(subdir);
-		rmtree_impl(n, subdir, ec);
-		if (ec)
-			return;
+		DIR * subdir = opendir(n.c_str());
+		if (!subdir)
+			return ec.assign(errno, std::system_category());
 
-		::rmdir(top.c_str());
+		{
+			dir_guard subdir_guard(subdir);
+			rmtree_impl(n, subdir, ec);
+			if (ec)
+				return;
+		}
+
+		if (::rmdir(n.c_str()) < 0)
+			return ec.assign(errno, std::system_category());
 	}
 }
 
@@ -242,3 +462,134 @@ void rmtree(std::string_view top, std::error_code & ec) noexcept
 
 	ec = ec2;
 }
+
+static void sync_path(std::string_view path, int flags, bool whole_fs)
+{
+	int fd = open(std::string(path).c_str(), O_RDONLY | flags);
+	if (fd < 0)
+		throw std::system_error(errno, std::system_category());
+
+#ifdef __linux__
+	int r = whole_fs? ::syncfs(fd): ::fsync(fd);
+#else
+	int r = whole_fs? (::sync(), 0): ::fsync(fd);
+#endif
+
+	int err = errno;
+	::close(fd);
+	if (r < 0)
+		throw std::system_error(err, std::system_category());
+}
+
+void sync_dir(std::string_view path)
+{
+	sync_path(path, O_DIRECTORY, /*whole_fs=*/false);
+}
+
+void sync_filesystem(std::string_view path)
+{
+	sync_path(path, 0, /*whole_fs=*/true);
+}
+
+void link_file(std::string_view target, std::string_view name)
+{
+	std::string t(target);
+	std::string n(name);
+
+	if (::unlink(n.c_str()) < 0 && errno != ENOENT)
+		throw std::system_error(errno, std::system_category());
+
+	if (::link(t.c_str(), n.c_str()) < 0)
+		throw std::system_error(errno, std::system_category());
+}
+
+void clone_file(std::string_view src, std::string_view dst, bool allow_hardlink)
+{
+	std::string s(src);
+	std::string d(dst);
+
+	// Never truncated, `dst` may itself be a link to another file.
+	if (::unlink(d.c_str()) < 0 && errno != ENOENT)
+		throw std::system_error(errno, std::system_category());
+
+#ifdef FICLONE
+	{
+		int in = open(s.c_str(), O_RDONLY);
+		if (in < 0)
+			throw std::system_error(errno, std::system_category());
+
+		int out = open(d.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+		if (out < 0)
+		{
+			int err = errno;
+			::close(in);
+			throw std::system_error(err, std::system_category());
+		}
+
+		int r = ::ioctl(out, FICLONE, in);
+		::close(out);
+		::close(in);
+		if (r == 0)
+			return;
+
+		::unlink(d.c_str());
+	}
+#endif
+
+	if (allow_hardlink && ::link(s.c_str(), d.c_str()) == 0)
+		return;
+
+	file fin;
+	fin.open_ro(src);
+
+	file fout;
+	fout.create(dst);
+	copy(fout.out_stream(), fin.in_stream());
+}
+
+void makedirs(std::string_view path, std::error_code & ec) noexcept
+{
+	try
+	{
+		std::string p(path);
+		for (size_t pos = 1; pos <= p.size(); ++pos)
+		{
+			if (pos != p.size() && p[pos] != '/')
+				continue;
+
+			p[pos] = 0;
+			if (::mkdir(p.c_str(), 0777) < 0 && errno != EEXIST)
+				return ec.assign(errno, std::system_category());
+			if (pos != p.size())
+				p[pos] = '/';
+		}
+
+		ec.clear();
+	}
+	catch (std::bad_alloc const &)
+	{
+		ec = std::make_error_code(std::errc::not_enough_memory);
+	}
+}
+
+void makedirs(std::string_view path)
+{
+	std::error_code ec;
+	makedirs(path, ec);
+	if (ec)
+		throw std::system_error(ec);
+}
+
+std::string current_dir()
+{
+	std::string r(256, 0);
+	while (!getcwd(&r[0], r.size()))
+	{
+		if (errno != ERANGE)
+			throw std::system_error(errno, std::system_category());
+		r.resize(r.size() * 2);
+	}
+
+	r.resize(strlen(r.c_str()));
+	return r;
+}
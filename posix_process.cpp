@@ -1,7 +1,391 @@
 #include "process.hpp"
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <system_error>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
+extern char ** environ;
+
+struct process::impl final
+	: ostream
+{
+	// Either the pid of our own child, or, if the child was started
+	// by the launcher, a pipe on which the launcher reports its wait status.
+	pid_t pid;
+	int status_fd;
+	int stdin_fd;
+
+	std::mutex mutex;
+	bool exited;
+	int32_t exit_code;
+
+	impl()
+		: pid(-1), status_fd(-1), stdin_fd(-1), exited(false), exit_code(0)
+	{
+	}
+
+	~impl()
+	{
+		if (status_fd >= 0)
+			::close(status_fd);
+		this->close();
+	}
+
+	size_t write(char const * buf, size_t len) override
+	{
+		assert(stdin_fd >= 0);
+
+		ssize_t r;
+		while ((r = ::write(stdin_fd, buf, len)) < 0 && errno == EINTR)
+		{
+		}
+
+		if (r < 0)
+			throw std::system_error(errno, std::system_category());
+		return r;
+	}
+
+	void close() override
+	{
+		if (stdin_fd >= 0)
+		{
+			::close(stdin_fd);
+			stdin_fd = -1;
+		}
+	}
+
+	void set_status(int status)
+	{
+		exited = true;
+		if (WIFEXITED(status))
+			exit_code = WEXITSTATUS(status);
+		else if (WIFSIGNALED(status))
+			exit_code = 128 + WTERMSIG(status);
+		else
+			exit_code = -1;
+	}
+};
+
+namespace {
+
+// The launcher is a small process forked off at startup, before the agent
+// grows. It forks and execs on the agent's behalf, so that the cost
+// of a launch doesn't depend on the size of the agent's address space.
+//
+// A request is a header followed by the NUL-terminated arguments.
+// The header holds the length of the arguments and a mask of the file
+// descriptors that come along with it: the child's stdin and its output.
+// The reply is a single byte carrying an errno value; on success it comes
+// with the read end of a pipe. The pipe first carries the outcome of
+// the exec, an errno value or 0, and eventually the wait status.
+std::mutex g_launcher_mutex;
+int g_launcher_fd = -1;
+
+bool read_exact(int fd, void * buf, size_t len)
+{
+	char * p = static_cast<char *>(buf);
+	while (len)
+	{
+		ssize_t r = ::read(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+bool write_exact(int fd, void const * buf, size_t len)
+{
+	char const * p = static_cast<char const *>(buf);
+	while (len)
+	{
+		ssize_t r = ::write(fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+bool send_exact(int sock, void const * buf, size_t len)
+{
+	char const * p = static_cast<char const *>(buf);
+	while (len)
+	{
+		ssize_t r = ::send(sock, p, len, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+// The descriptors go along with the first byte, the rest of a short send
+// follows without them.
+bool send_with_fds(int sock, void const * buf, size_t len, int const * fds, size_t fd_count)
+{
+	iovec iov = { const_cast<void *>(buf), len };
+
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	char cbuf[CMSG_SPACE(2 * sizeof(int))] = {};
+	assert(fd_count <= 2);
+	if (fd_count != 0)
+	{
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+
+		cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+	}
+
+	ssize_t r;
+	while ((r = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+	{
+	}
+
+	if (r <= 0)
+		return false;
+	return send_exact(sock, static_cast<char const *>(buf) + r, len - r);
+}
+
+bool recv_with_fds(int sock, void * buf, size_t len, int * fds, size_t & fd_count)
+{
+	iovec iov = { buf, len };
+
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof cbuf;
+
+	ssize_t r;
+	while ((r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+	{
+	}
+
+	fd_count = 0;
+	if (r <= 0)
+		return false;
+
+	cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	{
+		fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+	}
+
+	// The payload is tiny, but the socket is a stream.
+	return read_exact(sock, static_cast<char *>(buf) + r, len - r);
+}
+
+struct child_fds
+{
+	int in = -1;
+	int out = -1;
+
+	void close()
+	{
+		if (in >= 0)
+			::close(in);
+		if (out >= 0)
+			::close(out);
+		in = out = -1;
+	}
+};
+
+// Returns -1 and sets errno if the child couldn't be set up or exec
+// failed, rather than leaving that to look like the command's exit code.
+pid_t spawn(std::vector<char const *> const & arg_ptrs, child_fds const & fds, char const * cwd)
+{
+	// Closed by a successful exec; otherwise the child writes its errno.
+	int err_pipe[2];
+	if (pipe2(err_pipe, O_CLOEXEC) < 0)
+		return -1;
+
+	pid_t pid = vfork();
+	if (pid == 0)
+	{
+		auto fail = [&err_pipe] {
+			int err = errno;
+			write_exact(err_pipe[1], &err, sizeof err);
+			_exit(127);
+		};
+
+		if (cwd && chdir(cwd) < 0)
+			fail();
+
+		// The agent ignores SIGPIPE to survive children closing their stdin,
+		// the children themselves should get the default behavior.
+		signal(SIGPIPE, SIG_DFL);
+
+		if (fds.in >= 0 && dup2(fds.in, 0) < 0)
+			fail();
+
+		if (fds.out >= 0 && (dup2(fds.out, 1) < 0 || dup2(fds.out, 2) < 0))
+			fail();
+
+		execvp(arg_ptrs[0], (char **)arg_ptrs.data());
+		fail();
+	}
+
+	int err = errno;
+	::close(err_pipe[1]);
+
+	if (pid > 0)
+	{
+		int child_err;
+		if (read_exact(err_pipe[0], &child_err, sizeof child_err))
+		{
+			while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR)
+			{
+			}
+
+			pid = -1;
+			err = child_err;
+		}
+	}
+
+	::close(err_pipe[0]);
+	errno = err;
+	return pid;
+}
+
+[[noreturn]] void launcher_main(int sock)
+{
+	// Monitors are reaped automatically, they report through their pipe.
+	signal(SIGCHLD, SIG_IGN);
+
+	std::vector<char> args;
+	for (;;)
+	{
+		uint32_t hdr[2];
+		int fds[2];
+		size_t fd_count;
+		if (!recv_with_fds(sock, hdr, sizeof hdr, fds, fd_count))
+			_exit(0);
+
+		child_fds cfds;
+		size_t fd_idx = 0;
+		if ((hdr[1] & 1) && fd_idx < fd_count)
+			cfds.in = fds[fd_idx++];
+		if ((hdr[1] & 2) && fd_idx < fd_count)
+			cfds.out = fds[fd_idx++];
+
+		uint32_t len = hdr[0];
+		args.resize(len);
+		if (!read_exact(sock, args.data(), len))
+			_exit(0);
+
+		// The working directory, if any, comes before the arguments.
+		size_t pos = 0;
+		char const * cwd = nullptr;
+		if ((hdr[1] & 4) && len != 0)
+		{
+			cwd = args.data();
+			pos = strlen(cwd) + 1;
+		}
+
+		std::vector<char const *> arg_ptrs;
+		for (; pos < len; pos += strlen(args.data() + pos) + 1)
+			arg_ptrs.push_back(args.data() + pos);
+		arg_ptrs.push_back(nullptr);
+
+		int status_pipe[2];
+		if (pipe2(status_pipe, O_CLOEXEC) < 0)
+		{
+			uint8_t err = errno;
+			cfds.close();
+			if (!send_with_fds(sock, &err, 1, nullptr, 0))
+				_exit(0);
+			continue;
+		}
+
+		pid_t monitor = fork();
+		if (monitor == 0)
+		{
+			::close(sock);
+			::close(status_pipe[0]);
+			signal(SIGCHLD, SIG_DFL);
+
+			pid_t pid = spawn(arg_ptrs, cfds, cwd);
+			int err = pid < 0? errno: 0;
+			cfds.close();
+
+			if (!write_exact(status_pipe[1], &err, sizeof err) || pid < 0)
+				_exit(0);
+
+			int status;
+			if (waitpid(pid, &status, 0) < 0)
+				status = 0xff00;
+
+			write_exact(status_pipe[1], &status, sizeof status);
+			_exit(0);
+		}
+
+		uint8_t err = monitor < 0? errno: 0;
+		cfds.close();
+		::close(status_pipe[1]);
+		bool sent = send_with_fds(sock, &err, 1, &status_pipe[0], monitor < 0? 0: 1);
+		::close(status_pipe[0]);
+
+		// The agent is gone.
+		if (!sent)
+			_exit(0);
+	}
+}
+
+}
+
+void start_process_launcher()
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		throw std::system_error(errno, std::system_category());
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		int err = errno;
+		::close(sv[0]);
+		::close(sv[1]);
+		throw std::system_error(err, std::system_category());
+	}
+
+	if (pid == 0)
+	{
+		::close(sv[0]);
+		launcher_main(sv[1]);
+	}
+
+	::close(sv[1]);
+	g_launcher_fd = sv[0];
+}
+
 process::process()
 	: pimpl_(nullptr)
 {
@@ -27,57 +411,200 @@ process::~process()
 
 void process::close()
 {
+	delete pimpl_;
 	pimpl_ = nullptr;
 }
 
-void process::start(std::vector<std::string> args)
+void process::start(std::vector<std::string> args, process_options const & opts)
 {
-	std::vector<char const *> arg_ptrs;
-	for (std::string const & arg: args)
-		arg_ptrs.push_back(arg.c_str());
-	arg_ptrs.push_back(nullptr);
+	std::unique_ptr<impl> pimpl(new impl());
 
-	pid_t pid = vfork();
-	if (pid < 0)
-		throw std::system_error(errno, std::system_category());
+	// The child's ends of the pipes, closed once the child has them.
+	struct fds_guard
+		: child_fds
+	{
+		~fds_guard()
+		{
+			this->close();
+		}
+	} cfds;
 
-	if (pid == 0)
+	if (opts.pipe_stdin)
 	{
-		execvp(arg_ptrs[0], (char **)arg_ptrs.data());
-		_exit(errno);
+		static std::once_flag ignore_sigpipe;
+		std::call_once(ignore_sigpipe, [] { signal(SIGPIPE, SIG_IGN); });
+
+		int stdin_pipe[2];
+		if (pipe2(stdin_pipe, O_CLOEXEC) < 0)
+			throw std::system_error(errno, std::system_category());
+		cfds.in = stdin_pipe[0];
+		pimpl->stdin_fd = stdin_pipe[1];
+	}
+
+	if (!opts.output_file.empty())
+	{
+		cfds.out = open(opts.output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (cfds.out < 0)
+			throw std::system_error(errno, std::system_category());
+	}
+
+	if (g_launcher_fd >= 0)
+	{
+		uint32_t hdr[2] = { 0, 0 };
+
+		std::string req;
+		if (!opts.cwd.empty())
+		{
+			hdr[1] |= 4;
+			req.append(opts.cwd);
+			req.push_back(0);
+		}
+
+		for (std::string const & arg: args)
+		{
+			req.append(arg);
+			req.push_back(0);
+		}
+
+		hdr[0] = (uint32_t)req.size();
+		int fds[2];
+		size_t fd_count = 0;
+
+		if (cfds.in >= 0)
+		{
+			hdr[1] |= 1;
+			fds[fd_count++] = cfds.in;
+		}
+
+		if (cfds.out >= 0)
+		{
+			hdr[1] |= 2;
+			fds[fd_count++] = cfds.out;
+		}
+
+		{
+			std::lock_guard<std::mutex> l(g_launcher_mutex);
+			if (!send_with_fds(g_launcher_fd, hdr, sizeof hdr, fds, fd_count)
+				|| !send_exact(g_launcher_fd, req.data(), req.size()))
+			{
+				throw std::system_error(errno, std::system_category());
+			}
+
+			uint8_t err;
+			if (!recv_with_fds(g_launcher_fd, &err, 1, fds, fd_count) || (!err && fd_count != 1))
+				throw std::system_error(EPIPE, std::system_category());
+			if (fd_count != 0)
+				pimpl->status_fd = fds[0];
+			if (err)
+				throw std::system_error(err, std::system_category());
+		}
+
+		// The monitor reports the exec before anything else,
+		// other launches needn't wait for it.
+		int err;
+		if (!read_exact(pimpl->status_fd, &err, sizeof err))
+			throw std::system_error(EPIPE, std::system_category());
+		if (err)
+			throw std::system_error(err, std::system_category());
+	}
+	else
+	{
+		std::vector<char const *> arg_ptrs;
+		for (std::string const & arg: args)
+			arg_ptrs.push_back(arg.c_str());
+		arg_ptrs.push_back(nullptr);
+
+		pimpl->pid = spawn(arg_ptrs, cfds, opts.cwd.empty()? nullptr: opts.cwd.c_str());
+		if (pimpl->pid < 0)
+			throw std::system_error(errno, std::system_category());
 	}
 
 	this->close();
-	pimpl_ = reinterpret_cast<impl *>(pid);
+	pimpl_ = pimpl.release();
 }
 
 void process::start(std::string_view args)
 {
-	// XXX
+	this->start(std::vector<std::string>{ "/bin/sh", "-c", std::string(args) });
+}
+
+ostream & process::stdin_stream()
+{
+	assert(pimpl_);
+	return *pimpl_;
 }
 
 bool process::poll()
 {
 	assert(pimpl_);
 
-	// XXX
-	return false;
+	std::lock_guard<std::mutex> l(pimpl_->mutex);
+	if (pimpl_->exited)
+		return true;
+
+	if (pimpl_->status_fd >= 0)
+	{
+		pollfd pfd = { pimpl_->status_fd, POLLIN };
+		if (::poll(&pfd, 1, 0) <= 0)
+			return false;
+
+		int status;
+		if (!read_exact(pimpl_->status_fd, &status, sizeof status))
+			status = 0xff00;
+		pimpl_->set_status(status);
+	}
+	else
+	{
+		int status;
+		pid_t r = waitpid(pimpl_->pid, &status, WNOHANG);
+		if (r == 0)
+			return false;
+		if (r < 0)
+			throw std::system_error(errno, std::system_category());
+		pimpl_->set_status(status);
+	}
+
+	return true;
 }
 
 int32_t process::exit_code() const
 {
 	assert(pimpl_);
-
-	// XXX
-	return 0;
+	return pimpl_->exit_code;
 }
 
 int32_t process::wait()
 {
 	assert(pimpl_);
 
-	// XXX
-	return 0;
+	// Block until the child is gone without reaping it, the actual
+	// reaping happens under the lock in `poll`, so that concurrent
+	// waiters and pollers don't steal the status from each other.
+	while (!this->poll())
+	{
+		if (pimpl_->status_fd >= 0)
+		{
+			pollfd pfd = { pimpl_->status_fd, POLLIN };
+			if (::poll(&pfd, 1, -1) < 0 && errno != EINTR)
+				throw std::system_error(errno, std::system_category());
+		}
+		else
+		{
+			siginfo_t info;
+			if (waitid(P_PID, pimpl_->pid, &info, WEXITED | WNOWAIT) < 0 && errno != EINTR && errno != ECHILD)
+				throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	return pimpl_->exit_code;
+}
+
+std::vector<std::string> get_environment()
+{
+	std::vector<std::string> r;
+	for (char ** cur = environ; *cur; ++cur)
+		r.push_back(*cur);
+	return r;
 }
 
 int32_t run_process(std::string_view cmd)
@@ -0,0 +1,517 @@
+#include "server.hpp"
+#include "coro.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+struct server;
+
+static size_t const no_worker = ~(size_t)0;
+
+struct connection final
+	: istream, ostream, socket_stream
+{
+	connection(server & srv, int epfd, int fd)
+		: srv(srv), epfd(epfd), fd(fd), wait_events(EPOLLIN)
+	{
+	}
+
+	~connection()
+	{
+		// Also removes the socket from the epoll set.
+		::close(fd);
+	}
+
+	size_t read(char * buf, size_t len) override
+	{
+		if (skipped != 0)
+		{
+			if (len > skipped)
+				len = (size_t)skipped;
+			memset(buf, 0, len);
+			skipped -= len;
+			return len;
+		}
+
+		if (read_limit != 0 && len > read_limit)
+			len = read_limit;
+
+		for (;;)
+		{
+			ssize_t r = ::recv(fd, buf, len, 0);
+			if (r >= 0)
+			{
+				bytes_received += r;
+				return r;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				this->wait_ready(false);
+			else if (errno != EINTR)
+				throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	size_t write(char const * buf, size_t len) override
+	{
+		for (;;)
+		{
+			ssize_t r = ::send(fd, buf, len, MSG_NOSIGNAL);
+			if (r >= 0)
+				return r;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				this->wait_ready(true);
+			else if (errno != EINTR)
+				throw std::system_error(errno, std::system_category());
+		}
+	}
+
+	int native_handle() override
+	{
+		return fd;
+	}
+
+	void wait_ready(bool writable) override
+	{
+		if (!coroutine::in_coroutine())
+		{
+			pollfd pfd = { fd, (short)(writable? POLLOUT: POLLIN) };
+			::poll(&pfd, 1, -1);
+			return;
+		}
+
+		// The worker parks us once we're off its stack.
+		wait_events = writable? EPOLLOUT: EPOLLIN;
+		coroutine::yield();
+	}
+
+	uint64_t received() override
+	{
+		return bytes_received;
+	}
+
+	void limit_reads(size_t n) override
+	{
+		read_limit = n;
+	}
+
+	void skip(uint64_t len) override
+	{
+		skipped += len;
+	}
+
+	bool peer_closed() override
+	{
+		pollfd pfd = { fd, POLLRDHUP };
+		return ::poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+	}
+
+	server & srv;
+	int epfd;
+	int fd;
+	uint32_t wait_events;
+
+	uint64_t bytes_received = 0;
+	size_t read_limit = 0;
+	uint64_t skipped = 0;
+
+	// Set while the handler waits for another descriptor than its socket.
+	int wait_fd = -1;
+
+	// The worker that first ran the handler, it runs it to the end.
+	size_t worker = no_worker;
+
+	std::unique_ptr<coroutine> coro;
+};
+
+// The connection whose handler the worker thread is running.
+thread_local connection * t_running = nullptr;
+
+void wait_readable(int fd)
+{
+	connection * c = t_running;
+	if (!c || !coroutine::in_coroutine())
+	{
+		pollfd pfd = { fd, POLLIN };
+		::poll(&pfd, 1, -1);
+		return;
+	}
+
+	c->wait_fd = fd;
+	coroutine::yield();
+
+	// The one-shot registration has fired, drop it before the descriptor is reused.
+	epoll_ctl(c->epfd, EPOLL_CTL_DEL, fd, nullptr);
+	c->wait_fd = -1;
+}
+
+struct server
+{
+	server_options opts;
+	std::function<void(istream &, ostream &)> handler;
+	int listen_fd;
+	std::atomic<size_t> connections;
+
+	// A handler keeps its thread-local state across yields, so it's
+	// only ever resumed by its own worker. New connections go to
+	// whichever worker is idle first.
+	struct worker_queue
+	{
+		std::condition_variable cv;
+		std::deque<connection *> pinned;
+	};
+
+	std::mutex queue_mutex;
+	std::deque<connection *> fresh;
+	std::vector<std::unique_ptr<worker_queue>> workers;
+	std::vector<size_t> idle;
+
+	void schedule(connection * c)
+	{
+		worker_queue * w;
+
+		{
+			std::lock_guard<std::mutex> l(queue_mutex);
+			if (c->worker == no_worker)
+			{
+				fresh.push_back(c);
+				if (idle.empty())
+					return;
+
+				w = workers[idle.back()].get();
+				idle.pop_back();
+			}
+			else
+			{
+				w = workers[c->worker].get();
+				w->pinned.push_back(c);
+			}
+		}
+
+		w->cv.notify_one();
+	}
+
+	void park(connection * c)
+	{
+		// One-shot, so that a connection is never queued twice.
+		epoll_event ev = {};
+		ev.data.ptr = c;
+
+		int r;
+		if (c->wait_fd >= 0)
+		{
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			r = epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->wait_fd, &ev);
+		}
+		else
+		{
+			ev.events = c->wait_events | EPOLLONESHOT;
+			r = epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+		}
+
+		if (r < 0)
+			this->cancel(c);
+	}
+
+	// Unwinds the suspended handler before the connection goes away.
+	void cancel(connection * c)
+	{
+		t_running = c;
+
+		try
+		{
+			c->coro->cancel();
+		}
+		catch (...)
+		{
+		}
+
+		t_running = nullptr;
+		this->drop(c);
+	}
+
+	void drop(connection * c)
+	{
+		delete c;
+		--connections;
+	}
+
+	void accept_all(int epfd)
+	{
+		for (;;)
+		{
+			int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return;
+			}
+
+			if (opts.max_connections != 0 && connections >= opts.max_connections)
+			{
+				::close(fd);
+				continue;
+			}
+
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+			++connections;
+			auto c = new connection(*this, epfd, fd);
+
+			// The handler isn't set up until the client has something to say.
+			epoll_event ev = {};
+			ev.events = EPOLLIN | EPOLLONESHOT;
+			ev.data.ptr = c;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+				this->drop(c);
+		}
+	}
+
+	void reactor(int epfd)
+	{
+		epoll_event evs[64];
+		for (;;)
+		{
+			int n = epoll_wait(epfd, evs, sizeof evs / sizeof evs[0], -1);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				throw std::system_error(errno, std::system_category());
+			}
+
+			for (int i = 0; i != n; ++i)
+			{
+				if (evs[i].data.ptr == nullptr)
+					this->accept_all(epfd);
+				else
+					this->schedule(static_cast<connection *>(evs[i].data.ptr));
+			}
+		}
+	}
+
+	void worker(size_t idx)
+	{
+		worker_queue & w = *workers[idx];
+
+		for (;;)
+		{
+			connection * c;
+
+			{
+				std::unique_lock<std::mutex> l(queue_mutex);
+				while (w.pinned.empty() && fresh.empty())
+				{
+					idle.push_back(idx);
+					w.cv.wait(l);
+
+					// Still listed unless a new connection woke us.
+					idle.erase(std::remove(idle.begin(), idle.end(), idx), idle.end());
+				}
+
+				// Handlers already running come first.
+				if (!w.pinned.empty())
+				{
+					c = w.pinned.front();
+					w.pinned.pop_front();
+				}
+				else
+				{
+					c = fresh.front();
+					fresh.pop_front();
+					c->worker = idx;
+				}
+			}
+
+			t_running = c;
+
+			try
+			{
+				if (!c->coro)
+					c->coro.reset(new coroutine([this, c] { handler(*c, *c); }));
+				c->coro->resume();
+			}
+			catch (...)
+			{
+				// The connection is broken, there is no one to report to.
+			}
+
+			t_running = nullptr;
+
+			if (!c->coro || c->coro->done())
+				this->drop(c);
+			else
+				this->park(c);
+		}
+	}
+};
+
+int listen_on(int port)
+{
+	int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	bool v6 = fd >= 0;
+	if (v6)
+	{
+		int zero = 0;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof zero);
+	}
+	else
+	{
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			throw std::system_error(errno, std::system_category());
+	}
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+	sockaddr_storage ss = {};
+	socklen_t ss_len;
+
+	if (v6)
+	{
+		auto * sin6 = (sockaddr_in6 *)&ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_any;
+		sin6->sin6_port = htons(port);
+		ss_len = sizeof *sin6;
+	}
+	else
+	{
+		auto * sin = (sockaddr_in *)&ss;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		sin->sin_port = htons(port);
+		ss_len = sizeof *sin;
+	}
+
+	if (bind(fd, (sockaddr *)&ss, ss_len) < 0 || listen(fd, SOMAXCONN) < 0)
+	{
+		int err = errno;
+		::close(fd);
+		throw std::system_error(err, std::system_category());
+	}
+
+	return fd;
+}
+
+}
+
+struct wakeup::impl
+{
+	int fds[2];
+	std::atomic<bool> pending{ false };
+};
+
+wakeup::wakeup()
+	: pimpl_(new impl())
+{
+	if (pipe2(pimpl_->fds, O_NONBLOCK | O_CLOEXEC) < 0)
+	{
+		int err = errno;
+		delete pimpl_;
+		throw std::system_error(err, std::system_category());
+	}
+}
+
+wakeup::~wakeup()
+{
+	::close(pimpl_->fds[0]);
+	::close(pimpl_->fds[1]);
+	delete pimpl_;
+}
+
+void wakeup::signal()
+{
+	// At most one byte is ever in the pipe.
+	if (!pimpl_->pending.exchange(true))
+	{
+		char ch = 0;
+		while (::write(pimpl_->fds[1], &ch, 1) < 0 && errno == EINTR)
+		{
+		}
+	}
+}
+
+void wakeup::wait()
+{
+	for (;;)
+	{
+		char ch;
+		ssize_t r = ::read(pimpl_->fds[0], &ch, 1);
+		if (r == 1)
+		{
+			pimpl_->pending.store(false);
+			return;
+		}
+
+		if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			throw std::system_error(errno, std::system_category());
+
+		wait_readable(pimpl_->fds[0]);
+	}
+}
+
+void reactor_listen(int port, server_options const & opts, std::function<void(istream & in, ostream & out)> handler)
+{
+	server srv;
+	srv.opts = opts;
+	srv.handler = std::move(handler);
+	srv.listen_fd = listen_on(port);
+	srv.connections = 0;
+
+	if (srv.opts.reactors == 0)
+		srv.opts.reactors = 1;
+	if (srv.opts.workers == 0)
+		srv.opts.workers = 1;
+
+	std::vector<int> epfds;
+	for (size_t i = 0; i != srv.opts.reactors; ++i)
+	{
+		int epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0)
+			throw std::system_error(errno, std::system_category());
+
+		// Every reactor accepts; the kernel wakes only one of them per connection.
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+		ev.events |= EPOLLEXCLUSIVE;
+#endif
+		ev.data.ptr = nullptr;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, srv.listen_fd, &ev) < 0)
+			throw std::system_error(errno, std::system_category());
+
+		epfds.push_back(epfd);
+	}
+
+	for (size_t i = 0; i != srv.opts.workers; ++i)
+		srv.workers.emplace_back(new server::worker_queue());
+
+	for (size_t i = 0; i != srv.opts.workers; ++i)
+		std::thread([&srv, i] { srv.worker(i); }).detach();
+
+	for (size_t i = 1; i < epfds.size(); ++i)
+		std::thread([&srv, epfd = epfds[i]] { srv.reactor(epfd); }).detach();
+
+	srv.reactor(epfds[0]);
+}
@@ -0,0 +1,59 @@
+#include "trace.hpp"
+#include "file.hpp"
+#include <system_error>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+static int g_trace_signal_fd = -1;
+
+static void on_trace_signal(int)
+{
+	int saved_errno = errno;
+	char ch = 0;
+	(void)write(g_trace_signal_fd, &ch, 1);
+	errno = saved_errno;
+}
+
+void dump_trace_on_signal(std::string path)
+{
+	// The handler only pokes a pipe, the dump is
+	// written by a thread that waits on the other end.
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		throw std::system_error(errno, std::system_category());
+
+	g_trace_signal_fd = fds[1];
+
+	struct sigaction sa = {};
+	sa.sa_handler = &on_trace_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR1, &sa, nullptr) == -1)
+		throw std::system_error(errno, std::system_category());
+
+	int rd = fds[0];
+	std::thread([rd, path] {
+		for (;;)
+		{
+			char ch;
+			ssize_t r = read(rd, &ch, 1);
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				break;
+
+			try
+			{
+				file fout;
+				fout.create(path);
+				fout.out_stream().write_all(dump_trace());
+			}
+			catch (...)
+			{
+			}
+		}
+	}).detach();
+}
@@ -1,10 +1,24 @@
 #ifndef PROCESS_HPP
 #define PROCESS_HPP
 
+#include "stream.hpp"
 #include <string_view>
 #include <vector>
 #include <string>
 
+struct process_options
+{
+	// Connects the child's stdin to a pipe, which can then be written
+	// through `process::stdin_stream`. Otherwise, stdin is inherited.
+	bool pipe_stdin = false;
+
+	// Redirects the child's stdout and stderr to this file, if not empty.
+	std::string output_file;
+
+	// The child's working directory, if not empty; otherwise the agent's.
+	std::string cwd;
+};
+
 struct process
 {
 	process();
@@ -15,11 +29,15 @@ struct process
 	void close();
 
 	template <typename Range>
-	void start(Range const & r);
+	void start(Range const & r, process_options const & opts = process_options());
 
-	void start(std::vector<std::string> cmd);
+	void start(std::vector<std::string> cmd, process_options const & opts = process_options());
 	void start(std::string_view cmd);
 
+	// Only valid if started with `pipe_stdin`. Writes block while the pipe
+	// is full; close the stream to signal the end of input.
+	ostream & stdin_stream();
+
 	bool poll();
 	int32_t exit_code() const;
 
@@ -32,13 +50,20 @@ private:
 
 int32_t run_process(std::string_view cmd);
 
+// The environment the children inherit, as `name=value` strings.
+std::vector<std::string> get_environment();
+
+// Starts a helper process that will launch all subsequent processes.
+// Call early, while the address space of the caller is still small.
+void start_process_launcher();
+
 template <typename Range>
-void process::start(Range const & r)
+void process::start(Range const & r, process_options const & opts)
 {
 	std::vector<std::string> args;
 	for (auto && e: r)
 		args.push_back(e);
-	this->start(std::move(args));
+	this->start(std::move(args), opts);
 }
 
 #endif // PROCESS_HPP
@@ -0,0 +1,80 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include "stream.hpp"
+#include <functional>
+#include <stdint.h>
+
+struct server_options
+{
+	// Threads waiting for sockets to become ready.
+	size_t reactors = 1;
+
+	// Threads running the connection handlers, blocking ones included.
+	size_t workers = 4;
+
+	// Further connections are closed right after accept; 0 is unlimited.
+	size_t max_connections = 0;
+};
+
+// Implemented by the streams `reactor_listen` passes to handlers,
+// for layers that want to talk to the socket directly.
+struct socket_stream
+{
+	virtual int native_handle() = 0;
+
+	// Returns once the socket is ready; a handler is suspended meanwhile.
+	virtual void wait_ready(bool writable) = 0;
+
+	// Bytes `read` has taken from the socket so far.
+	virtual uint64_t received() = 0;
+
+	// Caps every `read` at `n` bytes, 0 lifts the cap; lets a caller
+	// drain whatever the layers above have read ahead.
+	virtual void limit_reads(size_t n) = 0;
+
+	// The next `len` bytes were taken from the socket behind the stream's
+	// back. `read` yields as many zero bytes in their place, so that
+	// the layers above keep their framing.
+	virtual void skip(uint64_t len) = 0;
+
+	// Whether the peer has closed the connection; doesn't block.
+	virtual bool peer_closed() = 0;
+
+protected:
+	~socket_stream() = default;
+};
+
+// Lets a handler wait for a signal from another thread.
+//
+// Within `reactor_listen`, the waiting handler is suspended and its
+// worker freed, the way it is while waiting for its socket; elsewhere
+// the thread blocks. Signals don't queue up, any number of them
+// before a `wait` wake it once.
+struct wakeup
+{
+	wakeup();
+	~wakeup();
+	wakeup(wakeup const &) = delete;
+	wakeup & operator=(wakeup const &) = delete;
+
+	void signal();
+	void wait();
+
+private:
+	struct impl;
+	impl * pimpl_;
+};
+
+// Accepts connections on `port` and runs `handler` for each of them.
+//
+// Handlers run as coroutines on a fixed pool of workers. Whenever
+// a socket read or write would block, the handler is suspended and its
+// socket parked in a reactor, so that idle keep-alive connections
+// and long polls don't occupy a worker.
+//
+// A handler is always resumed by the worker that first ran it, its
+// thread-local state is safe across suspensions.
+void reactor_listen(int port, server_options const & opts, std::function<void(istream & in, ostream & out)> handler);
+
+#endif // SERVER_HPP
@@ -1,18 +1,26 @@
 #include "tar.hpp"
+#include "file.hpp"
 #include <algorithm>
 #include <numeric>
 #include <stdint.h>
 #include "zlib.h"
 
-static void write_oct(char * buf, size_t len, uint64_t num)
+// Writes `len - 1` octal digits followed by a space.
+// Returns the sum of the written bytes, for the header checksum.
+static unsigned write_oct(char * buf, size_t len, uint64_t num)
 {
 	buf[--len] = ' ';
+	unsigned sum = ' ';
 
 	while (len)
 	{
-		buf[--len] = '0' + (num & 0x7);
+		char ch = '0' + (num & 0x7);
+		buf[--len] = ch;
+		sum += ch;
 		num >>= 3;
 	}
+
+	return sum;
 }
 
 static uint64_t load_oct(char const * buf, size_t len)
@@ -41,96 +49,220 @@ static uint64_t load_oct(char const * buf, size_t len)
 
 static char const g_empty_two_blocks[1024] = {};
 
-tarfile_writer::tarfile_writer(ostream & out)
-	: out_(out)
-{
-}
+// Large enough that a reader of a streamed archive sees few writes,
+// small enough to stay in L2.
+static size_t const g_tar_buffer_size = 256 * 1024;
 
-void tarfile_writer::add(std::string_view name, uint64_t size, uint64_t mtime, istream & file)
+// Below this, splicing costs more syscalls than the copy it saves.
+static uint64_t const g_min_splice = 64 * 1024;
+
+namespace {
+
+// The fields that are the same for every entry, and their share
+// of the checksum, so that only the rest needs to be summed per entry.
+struct header_template
 {
-	char buf[16 * 1024] = {};
+	char block[512];
+	unsigned checksum;
 
-	if (name.size() > 100)
-		throw std::runtime_error("tar name too long");
+	header_template()
+		: block()
+	{
+		// mode
+		memcpy(block + 100, "000666 ", 7);
 
-	// name
-	memcpy(buf, name.data(), name.size());
+		// uid, gid
+		memcpy(block + 108, "000000 ", 7);
+		memcpy(block + 116, "000000 ", 7);
 
-	// mode
-	memcpy(buf + 100, "000666 ", 7);
+		// typeflag
+		block[156] = '0';
 
-	// uid, gid
-	memcpy(buf + 108, "000000 ", 7);
-	memcpy(buf + 116, "000000 ", 7);
+		// magic+version
+		memcpy(block + 257, "ustar\0" "00", 8);
 
-	// size
-	write_oct(buf + 124, 12, size);
+		// The checksum field itself counts as spaces.
+		checksum = 8 * ' ';
+		for (unsigned char ch : block)
+			checksum += ch;
+	}
+};
 
-	// mtime
-	write_oct(buf + 136, 12, mtime);
+header_template const g_header_template;
 
-	// typeflag
-	buf[156] = '0';
+unsigned copy_name(char * dest, std::string_view name)
+{
+	memcpy(dest, name.data(), name.size());
 
-	// magic+version
-	memcpy(buf + 257, "ustar\x0000", 8);
+	unsigned sum = 0;
+	for (unsigned char ch : name)
+		sum += ch;
+	return sum;
+}
 
-	// chksum
-	write_oct(buf + 148, 8, std::accumulate(buf, buf + 512, (size_t)(0x20 * 8)));
+}
 
-	out_.write_all(buf, 512);
+tarfile_writer::tarfile_writer(ostream & out)
+	: out_(out), buf_(new char[g_tar_buffer_size]), len_(0)
+{
+}
 
-	size_t padding = 512 - (size % 512);
-	if (padding == 512)
-		padding = 0;
+void tarfile_writer::add(std::string_view name, uint64_t size, uint64_t mtime, istream & file)
+{
+	this->write_header(name, size, mtime, '0', {});
 
+	// The content is read straight into the buffer.
+	size_t padding = (512 - (size % 512)) % 512;
 	while (size)
 	{
-		size_t chunk = sizeof buf;
+		if (len_ == g_tar_buffer_size)
+			this->flush();
+
+		size_t chunk = g_tar_buffer_size - len_;
 		if (chunk > size)
 			chunk = (size_t)size;
-		size_t r = file.read(buf, chunk);
-		assert(r != 0);
 
-		size -= chunk;
-		out_.write_all(buf, chunk);
+		size_t r = file.read(buf_.get() + len_, chunk);
+		if (r == 0)
+			throw std::runtime_error("file shrank while being archived");
+
+		len_ += r;
+		size -= r;
 	}
 
-	if (padding)
+	if (g_tar_buffer_size - len_ < padding)
+		this->flush();
+
+	memset(buf_.get() + len_, 0, padding);
+	len_ += padding;
+}
+
+bool tarfile_writer::add_link(std::string_view name, std::string_view target, uint64_t mtime)
+{
+	// Unlike names, link targets have no prefix field.
+	if (target.size() > 100)
+		return false;
+
+	this->write_header(name, 0, mtime, '1', target);
+	return true;
+}
+
+void tarfile_writer::write_header(std::string_view name, uint64_t size, uint64_t mtime, char type, std::string_view link_target)
+{
+	// Long names are split at a slash into the ustar prefix and name fields.
+	std::string_view prefix;
+	if (name.size() > 100)
 	{
-		memset(buf, 0, padding);
-		out_.write_all(buf, padding);
+		size_t sep = name.rfind('/', 155);
+		if (sep == std::string_view::npos || sep == 0 || name.size() - sep - 1 > 100)
+			throw std::runtime_error("tar name too long");
+
+		prefix = name.substr(0, sep);
+		name = name.substr(sep + 1);
 	}
+
+	if (g_tar_buffer_size - len_ < 512)
+		this->flush();
+
+	char * header = buf_.get() + len_;
+	memcpy(header, g_header_template.block, 512);
+
+	unsigned chksum = g_header_template.checksum;
+	chksum += copy_name(header, name);
+	chksum += copy_name(header + 345, prefix);
+	chksum += write_oct(header + 124, 12, size);
+	chksum += write_oct(header + 136, 12, mtime);
+
+	if (type != header[156])
+	{
+		chksum += (unsigned char)type - (unsigned char)header[156];
+		header[156] = type;
+	}
+
+	chksum += copy_name(header + 157, link_target);
+	write_oct(header + 148, 8, chksum);
+	len_ += 512;
 }
 
 void tarfile_writer::close()
 {
-	out_.write_all(g_empty_two_blocks, sizeof g_empty_two_blocks);
+	if (g_tar_buffer_size - len_ < sizeof g_empty_two_blocks)
+		this->flush();
+
+	memcpy(buf_.get() + len_, g_empty_two_blocks, sizeof g_empty_two_blocks);
+	len_ += sizeof g_empty_two_blocks;
+
+	this->flush();
 	out_.close();
 }
 
+void tarfile_writer::flush()
+{
+	out_.write_all(buf_.get(), len_);
+	len_ = 0;
+}
+
 tarfile_reader::tarfile_reader(istream & in)
-	: in_(in), cur_len_(0), next_header_offset_(0)
+	: in_(in), buf_(new char[g_tar_buffer_size]), pos_(0), len_(0), cur_len_(0), next_header_offset_(0), is_link_(false)
 {
 }
 
+// Makes at least `n` bytes available at `pos_`, moving the ones
+// already there to the front if the rest wouldn't fit behind them.
+void tarfile_reader::fill(size_t n)
+{
+	if (pos_ == len_)
+	{
+		pos_ = 0;
+		len_ = 0;
+	}
+	else if (g_tar_buffer_size - pos_ < n)
+	{
+		memmove(buf_.get(), buf_.get() + pos_, len_ - pos_);
+		len_ -= pos_;
+		pos_ = 0;
+	}
+
+	while (len_ - pos_ < n)
+	{
+		size_t r = in_.read(buf_.get() + len_, g_tar_buffer_size - len_);
+		if (r == 0)
+			throw std::runtime_error("premature end of stream");
+		len_ += r;
+	}
+}
+
+bool tarfile_reader::is_link() const
+{
+	return is_link_;
+}
+
+std::string const & tarfile_reader::link_target() const
+{
+	return link_target_;
+}
+
 bool tarfile_reader::next(std::string & name, uint64_t & size, std::shared_ptr<istream> & content)
 {
-	char header[32*1024];
+	trace_span span("tarfile_reader::next");
+
 	for (;;)
 	{
 		while (next_header_offset_ != 0)
 		{
-			size_t chunk = sizeof header;
+			if (pos_ == len_)
+				this->fill(1);
+
+			size_t chunk = len_ - pos_;
 			if (chunk > next_header_offset_)
 				chunk = (size_t)next_header_offset_;
-			size_t r = in_.read(header, chunk);
-			if (r == 0)
-				throw std::runtime_error("premature end of stream");
-			next_header_offset_ -= r;
+			pos_ += chunk;
+			next_header_offset_ -= chunk;
 		}
 
-		in_.read_all(header, 512);
+		this->fill(512);
+		char * header = buf_.get() + pos_;
+		pos_ += 512;
 
 		if (memcmp(header, g_empty_two_blocks, 512) == 0)
 			return false;
@@ -141,8 +273,11 @@ bool tarfile_reader::next(std::string & name, uint64_t & size, std::shared_ptr<i
 		uint64_t chksum = load_oct(header + 148, 8);
 		memset(header + 148, ' ', 8);
 
-		uint64_t chk = std::accumulate(header, header + 512, 0);
-		if (chk != chksum)
+		// The sum is over unsigned bytes, some writers
+		// got that wrong and summed signed ones.
+		uint64_t chk = std::accumulate((unsigned char const *)header, (unsigned char const *)header + 512, (uint64_t)0);
+		int64_t signed_chk = std::accumulate((signed char const *)header, (signed char const *)header + 512, (int64_t)0);
+		if (chk != chksum && signed_chk != (int64_t)chksum)
 			throw std::runtime_error("invalid checksum");
 
 		size_t prefix_len = 0;
@@ -164,7 +299,22 @@ bool tarfile_reader::next(std::string & name, uint64_t & size, std::shared_ptr<i
 		}
 
 		name.append(header, name_len);
-		size = load_oct(header + 124, 12);
+
+		is_link_ = header[156] == '1';
+		if (is_link_)
+		{
+			size_t target_len = 0;
+			while (target_len < 100 && header[157 + target_len] != 0)
+				++target_len;
+			link_target_.assign(header + 157, target_len);
+		}
+		else
+		{
+			link_target_.clear();
+		}
+
+		// No data follows a hard link, whatever its size field says.
+		size = is_link_? 0: load_oct(header + 124, 12);
 		cur_len_ = size;
 		next_header_offset_ = (cur_len_ + 511) & ~(uint64_t)(0x1ff);
 		content = std::shared_ptr<istream>(std::shared_ptr<istream>(), this);
@@ -180,12 +330,58 @@ size_t tarfile_reader::read(char * buf, size_t len)
 	if (len == 0)
 		return 0;
 
-	size_t r = in_.read(buf, len);
+	size_t r;
+	if (pos_ != len_)
+	{
+		r = std::min(len, len_ - pos_);
+		memcpy(buf, buf_.get() + pos_, r);
+		pos_ += r;
+	}
+	else
+	{
+		r = in_.read(buf, len);
+		if (r == 0)
+			throw std::runtime_error("premature end of stream");
+	}
+
 	cur_len_ -= r;
 	next_header_offset_ -= r;
+	return r;
+}
 
-	if (r == 0 && cur_len_ != 0)
-		throw std::runtime_error("premature end of stream");
+void tarfile_reader::copy_content(ostream & out)
+{
+	while (cur_len_ != 0)
+	{
+		if (pos_ == len_)
+			this->fill(cur_len_ < g_tar_buffer_size? (size_t)cur_len_: g_tar_buffer_size);
 
-	return r;
+		size_t chunk = len_ - pos_;
+		if (chunk > cur_len_)
+			chunk = (size_t)cur_len_;
+
+		out.write_all(buf_.get() + pos_, chunk);
+		pos_ += chunk;
+		cur_len_ -= chunk;
+		next_header_offset_ -= chunk;
+	}
+}
+
+void tarfile_reader::copy_content(file & f)
+{
+	size_t buffered = len_ - pos_;
+	if (buffered > cur_len_)
+		buffered = (size_t)cur_len_;
+
+	auto * src = dynamic_cast<splice_source *>(&in_);
+	if (!src || cur_len_ - buffered < g_min_splice)
+		return this->copy_content(f.out_stream());
+
+	f.out_stream().write_all(buf_.get() + pos_, buffered);
+	pos_ += buffered;
+	cur_len_ -= buffered;
+
+	src->splice_to(f, cur_len_);
+	next_header_offset_ -= buffered + cur_len_;
+	cur_len_ = 0;
 }
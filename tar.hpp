@@ -2,53 +2,134 @@
 #define TAR_HPP
 
 #include "stream.hpp"
+#include "trace.hpp"
 #include <string_view>
 #include <stdint.h>
 #include <memory>
-#include <zlib/gzip_filter.hpp>
+#include <vector>
+#include <string.h>
+#include "deflate.hpp"
 
+struct file;
+
+// Headers, contents and padding of consecutive entries are packed
+// into one large buffer, which is only written out once it's full,
+// so small files cost no writes of their own. Nothing is written
+// before `close` unless the buffer fills up.
 struct tarfile_writer final
 {
 	explicit tarfile_writer(ostream & out);
 	void add(std::string_view name, uint64_t size, uint64_t mtime, istream & file);
+
+	// Adds a hard link to an earlier entry, which costs a header instead of
+	// the contents. Returns false if `target` doesn't fit the header,
+	// the caller should then add the contents after all.
+	bool add_link(std::string_view name, std::string_view target, uint64_t mtime);
+
 	void close();
 
 private:
+	void write_header(std::string_view name, uint64_t size, uint64_t mtime, char type, std::string_view link_target);
+	void flush();
+
 	ostream & out_;
+	std::unique_ptr<char[]> buf_;
+	size_t len_;
+};
+
+// Implemented by streams that can move their data into a file
+// without it passing through the reader's buffers.
+struct splice_source
+{
+	// Writes exactly the next `len` bytes of the stream to `f`.
+	virtual void splice_to(file & f, uint64_t len) = 0;
+
+protected:
+	~splice_source() = default;
 };
 
+// The archive is read ahead into a buffer the size of the writer's,
+// headers are parsed in place and the contents of small entries
+// are usually already there by the time they're asked for.
 struct tarfile_reader final
 	: private istream
 {
 	explicit tarfile_reader(istream & in);
 	bool next(std::string & name, uint64_t & size, std::shared_ptr<istream> & content);
 
+	// Of the entry returned by the last `next`. Hard links have no content,
+	// they refer to an earlier entry by `link_target`.
+	bool is_link() const;
+	std::string const & link_target() const;
+
+	// Writes the rest of the current entry's content straight from
+	// the buffer, in as few writes as it takes to fill it.
+	void copy_content(ostream & out);
+
+	// Like the above, but the part of a large entry that isn't
+	// buffered yet is spliced into `f` if the archive stream
+	// is a `splice_source`.
+	void copy_content(file & f);
+
 private:
 	size_t read(char * buf, size_t len) override;
+	void fill(size_t n);
 
 	istream & in_;
+	std::unique_ptr<char[]> buf_;
+	size_t pos_;
+	size_t len_;
 	uint64_t cur_len_;
 	uint64_t next_header_offset_;
+	bool is_link_;
+	std::string link_target_;
+};
+
+// Reads from a buffer owned by the caller.
+struct memory_istream final
+	: istream
+{
+	explicit memory_istream(std::string_view data)
+		: data_(data)
+	{
+	}
+
+	size_t read(char * buf, size_t len) override
+	{
+		if (len > data_.size())
+			len = data_.size();
+		memcpy(buf, data_.data(), len);
+		data_ = data_.substr(len);
+		return len;
+	}
+
+private:
+	std::string_view data_;
 };
 
+// Filter buffers start small, so that short streams stay cheap, and double
+// whenever a single call fills them, up to a size where the per-call
+// overhead of the filter and of the underlying stream stops mattering.
+static size_t const filter_min_buffer = 16 * 1024;
+static size_t const filter_max_buffer = 256 * 1024;
+
 template <typename Filter>
 struct filter_writer final
 	: ostream
 {
 	template <typename... P>
 	filter_writer(ostream & out, P &&... p)
-		: out_(out), filter_(std::forward<P>(p)...)
+		: out_(out), filter_(std::forward<P>(p)...), outbuf_(filter_min_buffer)
 	{
 	}
 
 	size_t write(char const * buf, size_t len) override
 	{
-		char outbuf[8*1024];
-
 		for (;;)
 		{
-			auto r = filter_.process(buf, len, outbuf, sizeof outbuf);
-			out_.write_all(outbuf, r.second);
+			auto r = filter_.process(buf, len, outbuf_.data(), outbuf_.size());
+			out_.write_all(outbuf_.data(), r.second);
+			this->grow(r.second);
 
 			if (r.first)
 				return r.first;
@@ -57,14 +138,13 @@ struct filter_writer final
 
 	void close() override
 	{
-		char outbuf[8*1024];
-
 		for (;;)
 		{
-			size_t r = filter_.finish(outbuf, sizeof outbuf);
+			size_t r = filter_.finish(outbuf_.data(), outbuf_.size());
 			if (r == 0)
 				break;
-			out_.write_all(outbuf, r);
+			out_.write_all(outbuf_.data(), r);
+			this->grow(r);
 		}
 
 		out_.close();
@@ -73,6 +153,13 @@ struct filter_writer final
 private:
 	ostream & out_;
 	Filter filter_;
+	std::vector<char> outbuf_;
+
+	void grow(size_t produced)
+	{
+		if (produced == outbuf_.size() && outbuf_.size() < filter_max_buffer)
+			outbuf_.resize(outbuf_.size() * 2);
+	}
 };
 
 template <typename Filter>
@@ -81,12 +168,14 @@ struct filter_reader final
 {
 	template <typename... P>
 	filter_reader(istream & in, P &&... p)
-		: in_(in), filter_(std::forward<P>(p)...), inptr_(inbuf_), inlen_(0)
+		: in_(in), filter_(std::forward<P>(p)...), inbuf_(filter_min_buffer), inptr_(inbuf_.data()), inlen_(0), last_full_(false)
 	{
 	}
 
 	size_t read(char * buf, size_t len) override
 	{
+		trace_span span("filter_reader::read");
+
 		if (inptr_ == nullptr)
 			return filter_.finish(buf, len);
 
@@ -94,8 +183,15 @@ struct filter_reader final
 		{
 			if (inlen_ == 0)
 			{
-				inlen_ = in_.read(inbuf_, sizeof inbuf_);
-				inptr_ = inlen_ == 0 ? nullptr : inbuf_;
+				trace_span fill_span("filter_reader::fill");
+
+				// The previous read filled the whole buffer, the input is fast.
+				if (last_full_ && inbuf_.size() < filter_max_buffer)
+					inbuf_.resize(inbuf_.size() * 2);
+
+				inlen_ = in_.read(inbuf_.data(), inbuf_.size());
+				inptr_ = inlen_ == 0 ? nullptr : inbuf_.data();
+				last_full_ = inlen_ == inbuf_.size();
 			}
 
 			if (inptr_ == nullptr)
@@ -114,9 +210,10 @@ private:
 	istream & in_;
 	Filter filter_;
 
-	char inbuf_[8 * 1024];
+	std::vector<char> inbuf_;
 	char * inptr_;
 	size_t inlen_;
+	bool last_full_;
 };
 
 #endif // TAR_HPP
@@ -1,11 +1,18 @@
 #include "tls.hpp"
+#include "file.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
+#include <cassert>
+#include <chrono>
+#include <climits>
 #include <exception>
+#include <memory>
+#include <mutex>
+#include <string.h>
 
-#if OPENSSL_VERSION_NUMBER >= 0x10100000
-#include <internal/bio.h>
-#else
+#if OPENSSL_VERSION_NUMBER < 0x10100000
 static void BIO_set_data(BIO * b, void * p)
 {
 	b->ptr = p;
@@ -24,23 +31,18 @@ static void BIO_set_init(BIO * b, int init)
 
 namespace {
 
+// Sits between OpenSSL and the underlying streams.
+//
+// Outgoing records are collected and written in one go when OpenSSL
+// flushes the BIO at the end of a handshake flight, or when `ctx` is done
+// with an SSL_write; incoming data is read ahead in large blocks,
+// so that the 5-byte record headers don't each cost a read.
 struct stream_bio final
 {
 	explicit stream_bio(void * stream)
-		: stream_(stream)
+		: stream_(stream), rpos_(0), rlen_(0)
 	{
-		static BIO_METHOD const meth = {
-			BIO_TYPE_SOURCE_SINK,
-			"cpp_stream_bio",
-
-			&bwrite,
-			&bread,
-			nullptr,
-			nullptr,
-			&ctrl,
-		};
-
-		bio_ = BIO_new((BIO_METHOD *)&meth);
+		bio_ = BIO_new(get_method());
 		if (bio_ == nullptr)
 			throw std::bad_alloc();
 
@@ -65,27 +67,83 @@ struct stream_bio final
 			std::rethrow_exception(err_);
 	}
 
+	void flush()
+	{
+		this->rethrow();
+		if (wbuf_.empty())
+			return;
+
+		static_cast<ostream *>(stream_)->write_all(wbuf_.data(), wbuf_.size());
+		wbuf_.clear();
+	}
+
 	BIO * get() const
 	{
 		return bio_;
 	}
 
 private:
+	// A full record with its header and the AEAD overhead.
+	static size_t const record_size = 16 * 1024 + 256;
+	static size_t const read_ahead_size = 2 * record_size;
+	static size_t const write_buffer_size = 4 * record_size;
+
 	BIO * bio_;
 	void * stream_;
 	std::exception_ptr err_;
 
+	std::unique_ptr<char[]> rbuf_;
+	size_t rpos_;
+	size_t rlen_;
+
+	std::vector<char> wbuf_;
+
+	static BIO_METHOD * get_method()
+	{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+		static BIO_METHOD * const meth = [] {
+			BIO_METHOD * meth = BIO_meth_new(BIO_TYPE_SOURCE_SINK, "cpp_stream_bio");
+			if (meth == nullptr)
+				throw std::bad_alloc();
+
+			BIO_meth_set_write(meth, &bwrite);
+			BIO_meth_set_read(meth, &bread);
+			BIO_meth_set_ctrl(meth, &ctrl);
+			return meth;
+		}();
+
+		return meth;
+#else
+		static BIO_METHOD const meth = {
+			BIO_TYPE_SOURCE_SINK,
+			"cpp_stream_bio",
+
+			&bwrite,
+			&bread,
+			nullptr,
+			nullptr,
+			&ctrl,
+		};
+
+		return (BIO_METHOD *)&meth;
+#endif
+	}
+
 	static int bwrite(BIO * bio, const char * buf, int len)
 	{
 		auto self = static_cast<stream_bio *>(BIO_get_data(bio));
 		if (self->err_)
 			return -1;
 
-		auto ss = static_cast<ostream *>(self->stream_);
-
 		try
 		{
-			return (int)ss->write(buf, len);
+			if (self->wbuf_.capacity() < write_buffer_size)
+				self->wbuf_.reserve(write_buffer_size);
+
+			self->wbuf_.insert(self->wbuf_.end(), buf, buf + len);
+			if (self->wbuf_.size() >= write_buffer_size)
+				self->flush();
+			return len;
 		}
 		catch (...)
 		{
@@ -104,7 +162,28 @@ private:
 
 		try
 		{
-			return (int)ss->read(buf, len);
+			if (self->rpos_ == self->rlen_)
+			{
+				// Large reads gain nothing from the extra copy.
+				if ((size_t)len >= read_ahead_size)
+					return (int)ss->read(buf, len);
+
+				if (!self->rbuf_)
+					self->rbuf_.reset(new char[read_ahead_size]);
+
+				self->rpos_ = 0;
+				self->rlen_ = ss->read(self->rbuf_.get(), read_ahead_size);
+				if (self->rlen_ == 0)
+					return 0;
+			}
+
+			size_t chunk = self->rlen_ - self->rpos_;
+			if (chunk > (size_t)len)
+				chunk = len;
+
+			memcpy(buf, self->rbuf_.get() + self->rpos_, chunk);
+			self->rpos_ += chunk;
+			return (int)chunk;
 		}
 		catch (...)
 		{
@@ -115,27 +194,50 @@ private:
 
 	static long ctrl(BIO * bio, int cmd, long, void *)
 	{
-		if (cmd == BIO_CTRL_DUP || cmd == BIO_CTRL_FLUSH)
+		auto self = static_cast<stream_bio *>(BIO_get_data(bio));
+
+		switch (cmd)
+		{
+		case BIO_CTRL_DUP:
 			return 1;
-		return 0;
+		case BIO_CTRL_PENDING:
+			return (long)(self->rlen_ - self->rpos_);
+		case BIO_CTRL_WPENDING:
+			return (long)self->wbuf_.size();
+		case BIO_CTRL_FLUSH:
+			try
+			{
+				self->flush();
+				return 1;
+			}
+			catch (...)
+			{
+				if (!self->err_)
+					self->err_ = std::current_exception();
+				return 0;
+			}
+		default:
+			return 0;
+		}
 	}
 };
 
-struct ctx final
-	: istream, ostream
+// The SSL_CTX is shared by all connections, so that the key and
+// the certificate are only loaded once and sessions can be resumed,
+// either from the server-side cache or from a ticket.
+struct server_context final
 {
-	stream_bio rbio;
-	stream_bio wbio;
-
 	SSL_CTX * sslctx;
-	SSL * ssl;
+	std::string key;
+	std::string cert;
+	std::vector<char> protos_bytes;
 
-	std::string proto;
+	uint64_t key_mtime;
+	uint64_t cert_mtime;
 
-	ctx(istream & in, ostream & out, std::string const & key, std::string const & cert, std::vector<std::string_view> const & protos)
-		: rbio(&in), wbio(&out), sslctx(nullptr), ssl(nullptr)
+	server_context(std::string const & key, std::string const & cert, std::vector<std::string_view> const & protos)
+		: key(key), cert(cert)
 	{
-		std::vector<char> protos_bytes;
 		for (auto && proto : protos)
 		{
 			assert(proto.size() < 255);
@@ -143,33 +245,153 @@ struct ctx final
 			protos_bytes.insert(protos_bytes.end(), proto.begin(), proto.end());
 		}
 
-		sslctx = SSL_CTX_new(TLSv1_2_server_method());
+		key_mtime = get_mtime(key);
+		cert_mtime = get_mtime(cert);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+		sslctx = SSL_CTX_new(TLS_server_method());
 		if (!sslctx)
 			throw std::bad_alloc();
+		SSL_CTX_set_min_proto_version(sslctx, TLS1_2_VERSION);
+#else
+		sslctx = SSL_CTX_new(SSLv23_server_method());
+		if (!sslctx)
+			throw std::bad_alloc();
+		SSL_CTX_set_options(sslctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
+#endif
+
+		static unsigned char const sid_ctx[] = "agent_maybe";
+		SSL_CTX_set_session_id_context(sslctx, sid_ctx, sizeof sid_ctx - 1);
+		SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(sslctx, 16 * 1024);
+
+		if (SSL_CTX_use_certificate_chain_file(sslctx, cert.c_str()) != 1
+			|| SSL_CTX_use_PrivateKey_file(sslctx, key.c_str(), SSL_FILETYPE_PEM) != 1
+			|| SSL_CTX_check_private_key(sslctx) != 1)
+		{
+			SSL_CTX_free(sslctx);
+			throw std::runtime_error("tls: failed to load the key or the certificate");
+		}
 
 		if (!protos_bytes.empty())
 			SSL_CTX_set_alpn_select_cb(sslctx, &alpn_select, &protos_bytes);
+	}
 
+	~server_context()
+	{
+		SSL_CTX_free(sslctx);
+	}
 
-		ssl = SSL_new(sslctx);
-		if (!ssl)
+	bool matches(std::string const & key, std::string const & cert, std::vector<std::string_view> const & protos) const
+	{
+		size_t pos = 0;
+		for (auto && proto : protos)
 		{
-			SSL_CTX_free(sslctx);
-			throw std::bad_alloc();
+			if (pos + 1 + proto.size() > protos_bytes.size()
+				|| (uint8_t)protos_bytes[pos] != proto.size()
+				|| std::string_view(protos_bytes.data() + pos + 1, proto.size()) != proto)
+			{
+				return false;
+			}
+
+			pos += 1 + proto.size();
 		}
 
-		SSL_use_certificate_file(ssl, cert.c_str(), SSL_FILETYPE_PEM);
-		SSL_use_PrivateKey_file(ssl, key.c_str(), SSL_FILETYPE_PEM);
+		return pos == protos_bytes.size() && this->key == key && this->cert == cert;
+	}
+
+	bool is_stale() const
+	{
+		return get_mtime(key) != key_mtime || get_mtime(cert) != cert_mtime;
+	}
+
+	static uint64_t get_mtime(std::string const & path)
+	{
+		file f;
+		std::error_code ec;
+		f.open_ro(path, ec);
+		return ec? 0: f.mtime();
+	}
+
+private:
+	static int alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg)
+	{
+		auto * protos = static_cast<std::vector<char> *>(arg);
+		if (SSL_select_next_proto((unsigned char **)out, outlen, (unsigned char const *)protos->data(), protos->size(), in, inlen) == OPENSSL_NPN_NEGOTIATED)
+			return SSL_TLSEXT_ERR_OK;
+		return SSL_TLSEXT_ERR_NOACK;
+	}
+};
+
+// Reloads the context when the key or the certificate change on disk;
+// they are checked at most every few seconds.
+std::shared_ptr<server_context> get_server_context(std::string const & key, std::string const & cert, std::vector<std::string_view> const & protos)
+{
+	static std::mutex mutex;
+	static std::shared_ptr<server_context> cached;
+	static std::chrono::steady_clock::time_point next_check;
+
+	auto now = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> l(mutex);
+	if (cached && cached->matches(key, cert, protos))
+	{
+		if (now < next_check)
+			return cached;
+
+		next_check = now + std::chrono::seconds(5);
+		if (!cached->is_stale())
+			return cached;
+
+		try
+		{
+			cached = std::make_shared<server_context>(key, cert, protos);
+		}
+		catch (std::runtime_error const &)
+		{
+			// Probably caught the files mid-update, keep the old ones for now.
+		}
+
+		return cached;
+	}
+
+	cached = std::make_shared<server_context>(key, cert, protos);
+	next_check = now + std::chrono::seconds(5);
+	return cached;
+}
+
+struct ctx final
+	: istream, ostream
+{
+	stream_bio rbio;
+	stream_bio wbio;
+
+	std::shared_ptr<server_context> sctx;
+	SSL * ssl;
+
+	std::string proto;
+
+	ctx(istream & in, ostream & out, std::string const & key, std::string const & cert, std::vector<std::string_view> const & protos)
+		: rbio(&in), wbio(&out), sctx(get_server_context(key, cert, protos)), ssl(nullptr)
+	{
+		ssl = SSL_new(sctx->sslctx);
+		if (!ssl)
+			throw std::bad_alloc();
+
 		SSL_set_bio(ssl, rbio.get(), wbio.get());
 		rbio.detach();
 		wbio.detach();
 
-		if (!SSL_accept(ssl))
+		auto start = std::chrono::steady_clock::now();
+		if (SSL_accept(ssl) != 1)
 		{
+			g_metrics.tls_handshake_failures.add();
 			SSL_free(ssl);
-			SSL_CTX_free(sslctx);
 			throw std::runtime_error("accept");
 		}
+		g_metrics.tls_handshake.record_since(start);
+
+		this->flush();
 
 		unsigned char const * alpn;
 		unsigned int alpn_len;
@@ -183,41 +405,71 @@ struct ctx final
 	{
 		if (ssl)
 			SSL_free(ssl);
-		if (sslctx)
-			SSL_CTX_free(sslctx);
 	}
 
 	size_t read(char * buf, size_t len) override
 	{
+		// The peer is likely waiting for whatever we've buffered.
+		this->flush();
+
 		int r = SSL_read(ssl, buf, len);
 		if (r < 0)
-		{
-			rbio.rethrow();
-			wbio.rethrow();
-			throw std::runtime_error("read error");
-		}
+			this->fail("read error");
 		return (size_t)r;
 	}
 
 	size_t write(char const * buf, size_t len) override
 	{
-		int r = SSL_write(ssl, buf, len);
-		if (r <= 0)
+		// Until the congestion window opens up, a record that spans several
+		// segments can't be decrypted before all of them arrive. The first
+		// bytes after an idle period go out in records that fit a segment,
+		// which is where small responses end; bulk transfers quickly
+		// move on to full-size records, which cost less per byte.
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_write_ > std::chrono::seconds(1))
+			ramp_sent_ = 0;
+		last_write_ = now;
+
+		size_t total = 0;
+		while (total < len)
 		{
-			rbio.rethrow();
-			wbio.rethrow();
-			throw std::runtime_error("write error");
+			size_t chunk = len - total;
+			if (ramp_sent_ < ramp_size && chunk > small_record_size)
+				chunk = small_record_size;
+			if (chunk > INT_MAX)
+				chunk = INT_MAX;
+
+			int r = SSL_write(ssl, buf + total, (int)chunk);
+			if (r <= 0)
+				this->fail("write error");
+
+			total += r;
+			if (ramp_sent_ < ramp_size)
+				ramp_sent_ += r;
 		}
-		return (size_t)r;
+
+		this->flush();
+		return total;
 	}
 
 private:
-	static int alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg)
+	// Fits a 1460-byte segment together with the record header and the AEAD tag.
+	static size_t const small_record_size = 1400;
+	static size_t const ramp_size = 16 * 1024;
+
+	std::chrono::steady_clock::time_point last_write_;
+	size_t ramp_sent_ = 0;
+
+	void flush()
 	{
-		auto * protos = static_cast<std::vector<char> *>(arg);
-		if (SSL_select_next_proto((unsigned char **)out, outlen, (unsigned char const *)protos->data(), protos->size(), in, inlen) == OPENSSL_NPN_NEGOTIATED)
-			return SSL_TLSEXT_ERR_OK;
-		return SSL_TLSEXT_ERR_NOACK;
+		wbio.flush();
+	}
+
+	[[noreturn]] void fail(char const * msg)
+	{
+		rbio.rethrow();
+		wbio.rethrow();
+		throw std::runtime_error(msg);
 	}
 };
 
@@ -225,6 +477,8 @@ private:
 
 std::string tls_server(std::shared_ptr<istream> & in_tls, std::shared_ptr<ostream> & out_tls, istream & in, ostream & out, std::string const & key, std::string const & cert, std::vector<std::string_view> const & protos)
 {
+	trace_span span("tls_server");
+
 	auto r = std::make_shared<ctx>(in, out, key, cert, protos);
 	in_tls = r;
 	out_tls = r;
@@ -0,0 +1,141 @@
+#include "trace.hpp"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <json.hpp>
+using nlohmann::json;
+
+std::atomic<bool> g_tracing_enabled{ false };
+
+namespace {
+
+struct trace_event
+{
+	std::atomic<char const *> name;
+	std::atomic<int64_t> start_us;
+	std::atomic<int64_t> dur_us;
+};
+
+// Written only by its thread. A dump may race with the writer and
+// see a half-updated slot, which costs a wrong timestamp at worst.
+struct trace_ring
+{
+	static size_t const capacity = 16 * 1024;
+
+	explicit trace_ring(size_t tid)
+		: tid(tid), head(0)
+	{
+	}
+
+	size_t tid;
+	std::atomic<uint64_t> head;
+	trace_event events[capacity];
+};
+
+// Rings outlive their threads, so that their spans can still be dumped;
+// a new thread takes over the ring of a finished one.
+std::mutex g_rings_mutex;
+std::vector<std::unique_ptr<trace_ring>> g_rings;
+std::vector<trace_ring *> g_free_rings;
+
+struct ring_holder
+{
+	trace_ring * ring = nullptr;
+
+	~ring_holder()
+	{
+		if (ring)
+		{
+			std::lock_guard<std::mutex> l(g_rings_mutex);
+			g_free_rings.push_back(ring);
+		}
+	}
+};
+
+thread_local ring_holder t_ring;
+
+auto const g_epoch = std::chrono::steady_clock::now();
+
+trace_ring * get_ring()
+{
+	if (t_ring.ring)
+		return t_ring.ring;
+
+	std::lock_guard<std::mutex> l(g_rings_mutex);
+	if (!g_free_rings.empty())
+	{
+		t_ring.ring = g_free_rings.back();
+		g_free_rings.pop_back();
+	}
+	else
+	{
+		g_rings.emplace_back(new trace_ring(g_rings.size() + 1));
+		t_ring.ring = g_rings.back().get();
+	}
+
+	return t_ring.ring;
+}
+
+}
+
+void enable_tracing(bool enable)
+{
+	g_tracing_enabled.store(enable, std::memory_order_relaxed);
+}
+
+void record_span(char const * name, std::chrono::steady_clock::time_point start) noexcept
+{
+	using std::chrono::duration_cast;
+	using std::chrono::microseconds;
+
+	auto end = std::chrono::steady_clock::now();
+
+	trace_ring * ring;
+	try
+	{
+		ring = get_ring();
+	}
+	catch (...)
+	{
+		return;
+	}
+
+	uint64_t h = ring->head.load(std::memory_order_relaxed);
+	trace_event & e = ring->events[h % trace_ring::capacity];
+	e.name.store(name, std::memory_order_relaxed);
+	e.start_us.store(duration_cast<microseconds>(start - g_epoch).count(), std::memory_order_relaxed);
+	e.dur_us.store(duration_cast<microseconds>(end - start).count(), std::memory_order_relaxed);
+	ring->head.store(h + 1, std::memory_order_release);
+}
+
+std::string dump_trace()
+{
+	json events = json::array();
+
+	std::lock_guard<std::mutex> l(g_rings_mutex);
+	for (auto && ring : g_rings)
+	{
+		uint64_t h = ring->head.load(std::memory_order_acquire);
+		uint64_t first = h > trace_ring::capacity? h - trace_ring::capacity: 0;
+
+		for (uint64_t i = first; i != h; ++i)
+		{
+			trace_event const & e = ring->events[i % trace_ring::capacity];
+			events.push_back({
+				{ "name", e.name.load(std::memory_order_relaxed) },
+				{ "ph", "X" },
+				{ "ts", e.start_us.load(std::memory_order_relaxed) },
+				{ "dur", e.dur_us.load(std::memory_order_relaxed) },
+				{ "pid", 1 },
+				{ "tid", ring->tid },
+			});
+		}
+	}
+
+	json r = {
+		{ "traceEvents", std::move(events) },
+		{ "displayTimeUnit", "ms" },
+	};
+	return r.dump();
+}
@@ -0,0 +1,57 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdint.h>
+
+// Span tracing, off unless enabled.
+//
+// Finished spans go into a ring buffer of the thread they finish on,
+// the most recent ones can be dumped in the Chrome trace format,
+// which chrome://tracing and Perfetto load.
+//
+//     void f()
+//     {
+//         trace_span span("f");
+//         ...
+//     }
+//
+// Names must be string literals, only the pointer is recorded.
+// A disabled span costs a relaxed load.
+extern std::atomic<bool> g_tracing_enabled;
+
+void enable_tracing(bool enable);
+void record_span(char const * name, std::chrono::steady_clock::time_point start) noexcept;
+
+struct trace_span
+{
+	explicit trace_span(char const * name) noexcept
+		: name_(g_tracing_enabled.load(std::memory_order_relaxed)? name: nullptr)
+	{
+		if (name_)
+			start_ = std::chrono::steady_clock::now();
+	}
+
+	~trace_span()
+	{
+		if (name_)
+			record_span(name_, start_);
+	}
+
+	trace_span(trace_span const &) = delete;
+	trace_span & operator=(trace_span const &) = delete;
+
+private:
+	char const * name_;
+	std::chrono::steady_clock::time_point start_;
+};
+
+// Returns the recorded spans as a JSON trace.
+std::string dump_trace();
+
+// Writes the trace into `path` whenever the process receives SIGUSR1.
+void dump_trace_on_signal(std::string path);
+
+#endif // TRACE_HPP
@@ -1,4 +1,5 @@
 #include "file.hpp"
+#include "trace.hpp"
 #include "utf.hpp"
 #include <memory>
 #include "win32_error.hpp"
@@ -89,6 +90,8 @@ void file::open_ro(std::string_view name, std::error_code & ec) noexcept
 
 void file::create(std::string_view name)
 {
+	trace_span span("file::create");
+
 	std::wstring name16 = to_utf16(name);
 
 	std::unique_ptr<impl> pimpl(new impl());
@@ -100,6 +103,28 @@ void file::create(std::string_view name)
 	pimpl_ = pimpl.release();
 }
 
+void file::create_temporary(std::string_view dir)
+{
+	std::wstring dir16 = to_utf16(dir);
+
+	wchar_t name[MAX_PATH];
+	if (!GetTempFileNameW(dir16.c_str(), L"rta", 0, name))
+		throw win32_error(GetLastError());
+
+	std::unique_ptr<impl> pimpl(new impl());
+	pimpl->h = CreateFileW(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, 0);
+	if (pimpl->h == INVALID_HANDLE_VALUE)
+	{
+		DWORD err = GetLastError();
+		DeleteFileW(name);
+		throw win32_error(err);
+	}
+
+	this->close();
+	pimpl_ = pimpl.release();
+}
+
 void file::close()
 {
 	if (pimpl_ != nullptr)
@@ -132,6 +157,82 @@ uint64_t file::mtime()
 	return (((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10000000ull - 11644473600ull;
 }
 
+file_version file::version()
+{
+	assert(pimpl_);
+
+	FILE_BASIC_INFO basic;
+	if (!GetFileInformationByHandleEx(pimpl_->h, FileBasicInfo, &basic, sizeof basic))
+		throw win32_error(GetLastError());
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(pimpl_->h, &info))
+		throw win32_error(GetLastError());
+
+	// In 100 ns units, which is as fine as NTFS gets.
+	file_version r;
+	r.mtime_ns = (uint64_t)basic.LastWriteTime.QuadPart * 100;
+	r.ctime_ns = (uint64_t)basic.ChangeTime.QuadPart * 100;
+	r.dev = info.dwVolumeSerialNumber;
+	r.ino = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	return r;
+}
+
+bool file::link_id(std::pair<uint64_t, uint64_t> & id)
+{
+	assert(pimpl_);
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(pimpl_->h, &info))
+		throw win32_error(GetLastError());
+
+	if (info.nNumberOfLinks < 2)
+		return false;
+
+	id = { info.dwVolumeSerialNumber, ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow };
+	return true;
+}
+
+void file::sync()
+{
+	assert(pimpl_);
+
+	if (!FlushFileBuffers(pimpl_->h))
+		throw win32_error(GetLastError());
+}
+
+size_t file::read_at(uint64_t offset, char * buf, size_t len)
+{
+	assert(pimpl_);
+
+	if (len > MAXDWORD)
+		len = MAXDWORD;
+
+	// A positioned read still moves the file pointer of a synchronous handle.
+	LARGE_INTEGER pos = {};
+	if (!SetFilePointerEx(pimpl_->h, pos, &pos, FILE_CURRENT))
+		throw win32_error(GetLastError());
+
+	OVERLAPPED ov = {};
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+
+	DWORD dwRead;
+	if (!ReadFile(pimpl_->h, buf, (DWORD)len, &dwRead, &ov) && GetLastError() != ERROR_HANDLE_EOF)
+		throw win32_error(GetLastError());
+
+	if (!SetFilePointerEx(pimpl_->h, pos, nullptr, FILE_BEGIN))
+		throw win32_error(GetLastError());
+
+	return dwRead;
+}
+
+void file::splice_from(socket_stream & sock, uint64_t len)
+{
+	// There is no reactor on Windows, hence no socket streams.
+	throw win32_error(ERROR_NOT_SUPPORTED);
+}
+
 istream & file::in_stream()
 {
 	return *pimpl_;
@@ -276,3 +377,128 @@ void rmtree(std::string_view top, std::error_code & ec) noexcept
 		ec = std::make_error_code(std::errc::not_enough_memory);
 	}
 }
+
+void sync_dir(std::string_view path)
+{
+	// NTFS journals directory changes, there's nothing to flush.
+}
+
+void sync_filesystem(std::string_view path)
+{
+	std::wstring path16 = to_utf16(path);
+
+	wchar_t mount[MAX_PATH];
+	if (!GetVolumePathNameW(path16.c_str(), mount, MAX_PATH))
+		throw win32_error(GetLastError());
+
+	// `C:\` is flushed through `\\.\C:`, which takes administrator rights.
+	std::wstring volume = L"\\\\.\\" + std::wstring(mount);
+	if (!volume.empty() && volume.back() == L'\\')
+		volume.pop_back();
+
+	HANDLE h = CreateFileW(volume.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, 0);
+	if (h == INVALID_HANDLE_VALUE)
+		throw win32_error(GetLastError());
+
+	BOOL ok = FlushFileBuffers(h);
+	DWORD err = GetLastError();
+	CloseHandle(h);
+	if (!ok)
+		throw win32_error(err);
+}
+
+void link_file(std::string_view target, std::string_view name)
+{
+	std::wstring target16 = to_utf16(target);
+	std::wstring name16 = to_utf16(name);
+
+	if (!DeleteFileW(name16.c_str()))
+	{
+		DWORD err = GetLastError();
+		if (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)
+			throw win32_error(err);
+	}
+
+	if (!CreateHardLinkW(name16.c_str(), target16.c_str(), nullptr))
+		throw win32_error(GetLastError());
+}
+
+void clone_file(std::string_view src, std::string_view dst, bool allow_hardlink)
+{
+	std::wstring src16 = to_utf16(src);
+	std::wstring dst16 = to_utf16(dst);
+
+	// Never truncated, `dst` may itself be a link to another file.
+	if (!DeleteFileW(dst16.c_str()))
+	{
+		DWORD err = GetLastError();
+		if (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)
+			throw win32_error(err);
+	}
+
+	if (allow_hardlink && CreateHardLinkW(dst16.c_str(), src16.c_str(), nullptr))
+		return;
+
+	// ReFS block cloning (FSCTL_DUPLICATE_EXTENTS_TO_FILE) isn't used yet.
+	if (!CopyFileW(src16.c_str(), dst16.c_str(), TRUE))
+		throw win32_error(GetLastError());
+}
+
+void makedirs(std::string_view path, std::error_code & ec) noexcept
+{
+	try
+	{
+		std::wstring p = to_utf16(path);
+		for (size_t pos = 1; pos <= p.size(); ++pos)
+		{
+			if (pos != p.size() && p[pos] != '\\' && p[pos] != '/')
+				continue;
+
+			// Skip the drive, `C:` can't be created.
+			if (pos == 2 && p[1] == ':')
+				continue;
+
+			wchar_t sep = pos != p.size()? p[pos]: 0;
+			p[pos] = 0;
+
+			if (!CreateDirectoryW(p.c_str(), nullptr))
+			{
+				DWORD err = GetLastError();
+				if (err != ERROR_ALREADY_EXISTS)
+					return make_win32_error_code(err, ec);
+			}
+
+			if (sep)
+				p[pos] = sep;
+		}
+
+		ec.clear();
+	}
+	catch (std::bad_alloc const &)
+	{
+		ec = std::make_error_code(std::errc::not_enough_memory);
+	}
+}
+
+void makedirs(std::string_view path)
+{
+	std::error_code ec;
+	makedirs(path, ec);
+	if (ec)
+		throw std::system_error(ec);
+}
+
+std::string current_dir()
+{
+	DWORD len = GetCurrentDirectoryW(0, nullptr);
+	if (len == 0)
+		throw win32_error(GetLastError());
+
+	std::wstring r(len, 0);
+	len = GetCurrentDirectoryW(len, &r[0]);
+	if (len == 0)
+		throw win32_error(GetLastError());
+
+	r.resize(len);
+	return to_utf8(r);
+}
@@ -1,8 +1,55 @@
 #include "process.hpp"
 #include "utf.hpp"
 #include "win32_error.hpp"
+#include <algorithm>
+#include <memory>
+#include <vector>
 #include <windows.h>
 
+struct process::impl final
+	: ostream
+{
+	HANDLE h;
+	HANDLE stdin_pipe;
+
+	impl()
+		: h(nullptr), stdin_pipe(nullptr)
+	{
+	}
+
+	~impl()
+	{
+		this->close();
+		if (h)
+			CloseHandle(h);
+	}
+
+	size_t write(char const * buf, size_t len) override
+	{
+		assert(stdin_pipe != nullptr);
+
+		if (len > MAXDWORD)
+			len = MAXDWORD;
+
+		DWORD dwWritten;
+		if (!WriteFile(stdin_pipe, buf, (DWORD)len, &dwWritten, nullptr))
+			throw win32_error(GetLastError());
+
+		return dwWritten;
+	}
+
+	void close() override
+	{
+		if (stdin_pipe)
+		{
+			CloseHandle(stdin_pipe);
+			stdin_pipe = nullptr;
+		}
+	}
+};
+
+void append_cmdline(std::string & cmdline, std::string_view arg);
+
 process::process()
 	: pimpl_(nullptr)
 {
@@ -28,11 +75,123 @@ process::~process()
 
 void process::close()
 {
-	auto h = reinterpret_cast<HANDLE>(pimpl_);
-	CloseHandle(h);
+	delete pimpl_;
 	pimpl_ = nullptr;
 }
 
+void process::start(std::vector<std::string> cmd, process_options const & opts)
+{
+	std::string cmdline;
+	for (std::string const & arg : cmd)
+		append_cmdline(cmdline, arg);
+
+	std::wstring cmd16 = to_utf16(cmdline);
+
+	std::unique_ptr<impl> pimpl(new impl());
+
+	STARTUPINFOW si = { sizeof si };
+	si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+	si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+	si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+	// Only the child's ends are inheritable.
+	SECURITY_ATTRIBUTES sa = { sizeof sa, nullptr, TRUE };
+
+	HANDLE child_stdin = nullptr;
+	if (opts.pipe_stdin)
+	{
+		if (!CreatePipe(&child_stdin, &pimpl->stdin_pipe, &sa, 0))
+			throw win32_error(GetLastError());
+		SetHandleInformation(pimpl->stdin_pipe, HANDLE_FLAG_INHERIT, 0);
+
+		si.dwFlags = STARTF_USESTDHANDLES;
+		si.hStdInput = child_stdin;
+	}
+
+	HANDLE child_output = nullptr;
+	if (!opts.output_file.empty())
+	{
+		child_output = CreateFileW(to_utf16(opts.output_file).c_str(), GENERIC_WRITE, FILE_SHARE_READ, &sa, CREATE_ALWAYS, 0, 0);
+		if (child_output == INVALID_HANDLE_VALUE)
+		{
+			DWORD err = GetLastError();
+			if (child_stdin)
+				CloseHandle(child_stdin);
+			throw win32_error(err);
+		}
+
+		si.dwFlags = STARTF_USESTDHANDLES;
+		si.hStdOutput = child_output;
+		si.hStdError = child_output;
+	}
+
+	std::wstring cwd16 = to_utf16(opts.cwd);
+
+	// The child inherits the handles on this list and no others; with
+	// just `bInheritHandles`, a child started meanwhile by another thread
+	// would get our pipe too and hold it open.
+	std::vector<HANDLE> inherited;
+	if (si.dwFlags & STARTF_USESTDHANDLES)
+	{
+		for (HANDLE h : { si.hStdInput, si.hStdOutput, si.hStdError })
+		{
+			DWORD flags;
+			if (h == nullptr || h == INVALID_HANDLE_VALUE || !GetHandleInformation(h, &flags) || !(flags & HANDLE_FLAG_INHERIT))
+				continue;
+			if (std::find(inherited.begin(), inherited.end(), h) == inherited.end())
+				inherited.push_back(h);
+		}
+	}
+
+	STARTUPINFOEXW six = {};
+	six.StartupInfo = si;
+	six.StartupInfo.cb = sizeof six;
+
+	std::unique_ptr<char[]> attr_buf;
+	BOOL ok = TRUE;
+	if (!inherited.empty())
+	{
+		SIZE_T attr_size = 0;
+		InitializeProcThreadAttributeList(nullptr, 1, 0, &attr_size);
+		attr_buf.reset(new char[attr_size]);
+
+		auto attrs = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attr_buf.get());
+		ok = InitializeProcThreadAttributeList(attrs, 1, 0, &attr_size);
+		if (ok)
+		{
+			six.lpAttributeList = attrs;
+			ok = UpdateProcThreadAttribute(attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+				inherited.data(), inherited.size() * sizeof(HANDLE), nullptr, nullptr);
+		}
+	}
+
+	PROCESS_INFORMATION pi;
+	if (ok)
+	{
+		ok = CreateProcessW(nullptr, &cmd16[0], nullptr, nullptr, !inherited.empty(),
+			six.lpAttributeList? EXTENDED_STARTUPINFO_PRESENT: 0, nullptr,
+			cwd16.empty()? nullptr: cwd16.c_str(), &six.StartupInfo, &pi);
+	}
+	DWORD err = GetLastError();
+
+	if (six.lpAttributeList)
+		DeleteProcThreadAttributeList(six.lpAttributeList);
+
+	if (child_stdin)
+		CloseHandle(child_stdin);
+	if (child_output)
+		CloseHandle(child_output);
+
+	if (!ok)
+		throw win32_error(err);
+
+	CloseHandle(pi.hThread);
+	pimpl->h = pi.hProcess;
+
+	this->close();
+	pimpl_ = pimpl.release();
+}
+
 void process::start(std::string_view cmd)
 {
 	std::wstring cmd16 = to_utf16(cmd);
@@ -45,15 +204,24 @@ void process::start(std::string_view cmd)
 
 	CloseHandle(pi.hThread);
 
+	std::unique_ptr<impl> pimpl(new impl());
+	pimpl->h = pi.hProcess;
+
 	this->close();
-	pimpl_ = reinterpret_cast<impl *>(pi.hProcess);
+	pimpl_ = pimpl.release();
+}
+
+ostream & process::stdin_stream()
+{
+	assert(pimpl_);
+	return *pimpl_;
 }
 
 bool process::poll()
 {
 	assert(pimpl_);
 
-	auto h = reinterpret_cast<HANDLE>(pimpl_);
+	auto h = pimpl_->h;
 	return WaitForSingleObject(h, 0) == WAIT_OBJECT_0;
 }
 
@@ -61,7 +229,7 @@ int32_t process::exit_code() const
 {
 	assert(pimpl_);
 
-	auto h = reinterpret_cast<HANDLE>(pimpl_);
+	auto h = pimpl_->h;
 
 	DWORD exit_code;
 	GetExitCodeProcess(h, &exit_code);
@@ -73,7 +241,7 @@ int32_t process::wait()
 {
 	assert(pimpl_);
 
-	auto h = reinterpret_cast<HANDLE>(pimpl_);
+	auto h = pimpl_->h;
 	WaitForSingleObject(h, INFINITE);
 
 	DWORD exit_code;
@@ -82,6 +250,21 @@ int32_t process::wait()
 	return exit_code;
 }
 
+std::vector<std::string> get_environment()
+{
+	std::vector<std::string> r;
+
+	wchar_t * env = GetEnvironmentStringsW();
+	if (!env)
+		throw win32_error(GetLastError());
+
+	for (wchar_t const * cur = env; *cur; cur += wcslen(cur) + 1)
+		r.push_back(to_utf8(cur));
+
+	FreeEnvironmentStringsW(env);
+	return r;
+}
+
 void append_cmdline(std::string & cmdline, std::string_view arg)
 {
 	if (!cmdline.empty())
@@ -138,3 +321,9 @@ int32_t run_process(std::string_view cmd)
 	p.start(cmd);
 	return p.wait();
 }
+
+void start_process_launcher()
+{
+	// CreateProcess doesn't copy the caller's address space,
+	// there is nothing to gain from a helper.
+}
@@ -0,0 +1,44 @@
+#include "server.hpp"
+#include <socket.hpp>
+#include <condition_variable>
+#include <mutex>
+
+struct wakeup::impl
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	bool pending = false;
+};
+
+wakeup::wakeup()
+	: pimpl_(new impl())
+{
+}
+
+wakeup::~wakeup()
+{
+	delete pimpl_;
+}
+
+void wakeup::signal()
+{
+	{
+		std::lock_guard<std::mutex> l(pimpl_->mutex);
+		pimpl_->pending = true;
+	}
+
+	pimpl_->cv.notify_one();
+}
+
+void wakeup::wait()
+{
+	std::unique_lock<std::mutex> l(pimpl_->mutex);
+	pimpl_->cv.wait(l, [this] { return pimpl_->pending; });
+	pimpl_->pending = false;
+}
+
+void reactor_listen(int port, server_options const & opts, std::function<void(istream & in, ostream & out)> handler)
+{
+	// There is no reactor on Windows yet, run a thread per connection.
+	tcp_listen(port, std::move(handler));
+}
@@ -0,0 +1,6 @@
+#include "trace.hpp"
+
+void dump_trace_on_signal(std::string path)
+{
+	// There is no SIGUSR1, use GET /trace.
+}